@@ -0,0 +1,61 @@
+#ifndef AABB_H
+#define AABB_H
+
+#include <math.h>
+#include <stdbool.h>
+
+#include "common.h"
+#include "ray.h"
+#include "vec3.h"
+
+typedef struct aabb {
+    point3 minimum;
+    point3 maximum;
+} aabb;
+
+static inline aabb Aabb_Sphere(const sphere *s) {
+    const vec3 r = {{s->radius, s->radius, s->radius}};
+    return (aabb){Vec3_Sub(&s->center, &r), Vec3_Add(&s->center, &r)};
+}
+
+static inline aabb Aabb_Surround(const aabb *a, const aabb *b) {
+    aabb result;
+    for (int i = 0; i < 3; ++i) {
+        result.minimum.e[i] = fmin(a->minimum.e[i], b->minimum.e[i]);
+        result.maximum.e[i] = fmax(a->maximum.e[i], b->maximum.e[i]);
+    }
+    return result;
+}
+
+// Reciprocal direction for the slab test, kept finite because fast-math
+// assumes no infinities
+static inline vec3 Aabb_InvDirection(const vec3 *direction) {
+    vec3 inv;
+    for (int i = 0; i < 3; ++i) {
+        const double d = direction->e[i];
+        inv.e[i] = 1.0 / (fabs(d) > 1e-12 ? d : copysign(1e-12, d));
+    }
+    return inv;
+}
+
+static inline bool Aabb_Hit(const aabb *box, const ray *r, const vec3 *invDir,
+                            double tMin, double tMax, double *tEnter) {
+    for (int i = 0; i < 3; ++i) {
+        double t0 = (box->minimum.e[i] - r->origin.e[i]) * invDir->e[i];
+        double t1 = (box->maximum.e[i] - r->origin.e[i]) * invDir->e[i];
+        if (t0 > t1) {
+            const double tmp = t0;
+            t0 = t1;
+            t1 = tmp;
+        }
+        tMin = t0 > tMin ? t0 : tMin;
+        tMax = t1 < tMax ? t1 : tMax;
+        if (tMax < tMin) {
+            return false;
+        }
+    }
+    *tEnter = tMin;
+    return true;
+}
+
+#endif
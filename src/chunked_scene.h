@@ -0,0 +1,749 @@
+#ifndef CHUNKED_SCENE_H
+#define CHUNKED_SCENE_H
+
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "aabb.h"
+#include "common.h"
+#include "hittable_list.h"
+#include "sphere.h"
+
+// On-disk scene for geometry that doesn't fit in memory. Spheres are split
+// into spatially coherent chunks, each stored with its own local BVH. The
+// top-level BVH over the chunks stays resident while chunk data is paged in
+// from a memory-mapped file into a small per-thread cache.
+//
+// File layout:
+//   chunked_scene_header
+//   bvh_node[topNodeCount]   top-level BVH, leaves reference chunks
+//   scene_chunk[chunkCount]  chunk table
+//   chunk data               per chunk: bvh_node[nodeCount], sphere[count]
+//
+// Structs are stored in native layout, so a file is only readable by a
+// build for the same platform.
+
+#define CHUNKED_SCENE_MAGIC "RTSCENE1"
+#define CHUNKED_SCENE_ALIGN 64
+#define CHUNKED_SCENE_LEAF_SIZE 4
+#define CHUNKED_SCENE_STACK_SIZE 64
+
+typedef struct bvh_node {
+    aabb box;
+    // Interior nodes: children are at first and first + 1, count is 0.
+    // Leaves: count spheres starting at first. In the top-level BVH a leaf
+    // holds a single chunk and first is the chunk index.
+    uint32_t first;
+    uint32_t count;
+} bvh_node;
+
+typedef struct chunked_scene_header {
+    char magic[8];
+    uint32_t topNodeCount;
+    uint32_t chunkCount;
+    uint64_t maxChunkBytes;
+    uint32_t materialMask;
+    uint32_t reserved;
+} chunked_scene_header;
+
+typedef struct scene_chunk {
+    uint64_t offset;
+    uint32_t nodeCount;
+    uint32_t sphereCount;
+} scene_chunk;
+
+typedef struct chunked_scene {
+    int fd;
+    unsigned char *mapping;
+    size_t mappingSize;
+    bvh_node *topNodes;
+    uint32_t topNodeCount;
+    scene_chunk *chunks;
+    uint32_t chunkCount;
+    size_t maxChunkBytes;
+    uint32_t materialMask;
+} chunked_scene;
+
+#define CHUNK_MAP_EMPTY UINT32_MAX
+
+// Open addressing hash map from chunk index to a small int, so per-thread
+// bookkeeping grows with what is resident or queued rather than with the
+// number of chunks in the scene
+typedef struct chunk_map {
+    uint32_t mask;
+    uint32_t *keys;
+    int32_t *values;
+} chunk_map;
+
+// A queue of rays waiting on one chunk, linked through chunk_query.next
+typedef struct chunk_queue {
+    uint32_t chunk;
+    int32_t head;
+    uint32_t length;
+} chunk_queue;
+
+// Per-thread bounded set of resident chunks with least recently used
+// eviction
+typedef struct chunk_cache {
+    const chunked_scene *scene;
+    int slotCount;
+    unsigned char *slots;
+    uint32_t *slotChunk;
+    uint64_t *slotLastUse;
+    // resident chunk -> slot
+    chunk_map chunkSlot;
+    uint64_t tick;
+    uint64_t hits;
+    uint64_t misses;
+    // Hits are copied here since the chunk they came from may be evicted
+    // before the material is used
+    material hitMaterial;
+    // Non-empty queues of ChunkedScene_HitQueued and chunk -> queue. A ray
+    // waits on one chunk at a time, so they are sized by the largest batch.
+    chunk_queue *queues;
+    uint32_t queueCount;
+    uint32_t queueCapacity;
+    chunk_map chunkQueue;
+} chunk_cache;
+
+static inline void ChunkMap_Init(chunk_map *m, uint32_t capacity) {
+    uint32_t size = 2;
+    while (size < 2 * (uint64_t)capacity) {
+        size *= 2;
+    }
+    m->mask = size - 1;
+    m->keys = (uint32_t *)malloc(size * sizeof(uint32_t));
+    m->values = (int32_t *)malloc(size * sizeof(int32_t));
+    for (uint32_t i = 0; i < size; ++i) {
+        m->keys[i] = CHUNK_MAP_EMPTY;
+    }
+}
+
+static inline void ChunkMap_Free(chunk_map *m) {
+    free(m->keys);
+    free(m->values);
+}
+
+static inline uint32_t ChunkMap_Home(const chunk_map *m, uint32_t key) {
+    return (key * 2654435761u) & m->mask;
+}
+
+// Returns the value stored for key, NULL if there is none
+static inline int32_t *ChunkMap_Find(const chunk_map *m, uint32_t key) {
+    for (uint32_t i = ChunkMap_Home(m, key);; i = (i + 1) & m->mask) {
+        if (m->keys[i] == key) {
+            return &m->values[i];
+        }
+        if (m->keys[i] == CHUNK_MAP_EMPTY) {
+            return NULL;
+        }
+    }
+}
+
+// Adds a key that is not in the map yet. The map must have room, it holds
+// the capacity it was initialized with.
+static inline void ChunkMap_Insert(chunk_map *m, uint32_t key, int32_t value) {
+    uint32_t i = ChunkMap_Home(m, key);
+    while (m->keys[i] != CHUNK_MAP_EMPTY) {
+        i = (i + 1) & m->mask;
+    }
+    m->keys[i] = key;
+    m->values[i] = value;
+}
+
+// Removes key, shifting later entries of its probe run back into the gap
+static inline void ChunkMap_Remove(chunk_map *m, uint32_t key) {
+    uint32_t i = ChunkMap_Home(m, key);
+    while (m->keys[i] != key) {
+        if (m->keys[i] == CHUNK_MAP_EMPTY) {
+            return;
+        }
+        i = (i + 1) & m->mask;
+    }
+    for (uint32_t j = (i + 1) & m->mask; m->keys[j] != CHUNK_MAP_EMPTY;
+         j = (j + 1) & m->mask) {
+        // entries whose home lies cyclically in (i, j] stay where they are
+        const uint32_t home = ChunkMap_Home(m, m->keys[j]);
+        if (((j - home) & m->mask) >= ((j - i) & m->mask)) {
+            m->keys[i] = m->keys[j];
+            m->values[i] = m->values[j];
+            i = j;
+        }
+    }
+    m->keys[i] = CHUNK_MAP_EMPTY;
+}
+
+// A ray traced together with others by ChunkedScene_HitQueued, which keeps
+// its place in the top-level BVH while it waits for the next chunk
+typedef struct chunk_query {
+    ray r;
+    vec3 invDir;
+    // closest hit so far, the ray's tMax on input
+    double tMax;
+    hit_record *rec;
+    // the hit's material is copied here, like chunk_cache.hitMaterial
+    material *hitMaterial;
+    // stop at the first hit, for shadow rays
+    bool anyHit;
+    bool hit;
+    // free for the caller to map queries back to its own data
+    uint32_t tag;
+    int32_t next;
+    int top;
+    uint32_t stack[CHUNKED_SCENE_STACK_SIZE];
+} chunk_query;
+
+// Building
+
+typedef struct bvh_builder {
+    sphere *spheres;
+    bvh_node *nodes;
+    uint32_t nodeCount;
+    uint32_t nodeCapacity;
+    uint32_t leafSize;
+} bvh_builder;
+
+static inline int Bvh_CompareCenters(const void *a, const void *b,
+                                     int axis) {
+    const double ca = ((const sphere *)a)->center.e[axis];
+    const double cb = ((const sphere *)b)->center.e[axis];
+    return (ca > cb) - (ca < cb);
+}
+
+static int Bvh_CompareX(const void *a, const void *b) {
+    return Bvh_CompareCenters(a, b, 0);
+}
+
+static int Bvh_CompareY(const void *a, const void *b) {
+    return Bvh_CompareCenters(a, b, 1);
+}
+
+static int Bvh_CompareZ(const void *a, const void *b) {
+    return Bvh_CompareCenters(a, b, 2);
+}
+
+static int (*const bvhCompare[3])(const void *, const void *) = {
+    Bvh_CompareX, Bvh_CompareY, Bvh_CompareZ};
+
+static inline uint32_t Bvh_AllocNodes(bvh_builder *b, uint32_t count) {
+    if (b->nodeCount + count > b->nodeCapacity) {
+        b->nodeCapacity = (b->nodeCount + count) * 2;
+        b->nodes = (bvh_node *)realloc(b->nodes,
+                                       b->nodeCapacity * sizeof(bvh_node));
+    }
+    const uint32_t index = b->nodeCount;
+    b->nodeCount += count;
+    return index;
+}
+
+// Median split along the axis with the widest spread of sphere centers
+static inline void Bvh_Build(bvh_builder *b, uint32_t nodeIndex,
+                             uint32_t begin, uint32_t end) {
+    aabb box = Aabb_Sphere(&b->spheres[begin]);
+    aabb centers = {b->spheres[begin].center, b->spheres[begin].center};
+    for (uint32_t i = begin + 1; i < end; ++i) {
+        const aabb sphereBox = Aabb_Sphere(&b->spheres[i]);
+        const aabb centerBox = {b->spheres[i].center, b->spheres[i].center};
+        box = Aabb_Surround(&box, &sphereBox);
+        centers = Aabb_Surround(&centers, &centerBox);
+    }
+    b->nodes[nodeIndex].box = box;
+
+    if (end - begin <= b->leafSize) {
+        b->nodes[nodeIndex].first = begin;
+        b->nodes[nodeIndex].count = end - begin;
+        return;
+    }
+
+    const vec3 extent = Vec3_Sub(&centers.maximum, &centers.minimum);
+    int axis = 0;
+    if (extent.e[1] > extent.e[axis]) {
+        axis = 1;
+    }
+    if (extent.e[2] > extent.e[axis]) {
+        axis = 2;
+    }
+    qsort(&b->spheres[begin], end - begin, sizeof(sphere), bvhCompare[axis]);
+
+    const uint32_t mid = begin + (end - begin) / 2;
+    const uint32_t child = Bvh_AllocNodes(b, 2);
+    b->nodes[nodeIndex].first = child;
+    b->nodes[nodeIndex].count = 0;
+    Bvh_Build(b, child, begin, mid);
+    Bvh_Build(b, child + 1, mid, end);
+}
+
+static inline size_t ChunkedScene_AlignUp(size_t size) {
+    return (size + CHUNKED_SCENE_ALIGN - 1) &
+           ~(size_t)(CHUNKED_SCENE_ALIGN - 1);
+}
+
+// Splits the scene into chunks of at most chunkSize spheres and writes it to
+// path. The build runs in memory and reorders the list's spheres in place.
+static inline bool ChunkedScene_Write(const char *path, hittable_list *hl,
+                                      uint32_t chunkSize) {
+    if (hl->count > UINT32_MAX) {
+        fprintf(stderr, "Chunked scenes hold at most %u spheres\n",
+                UINT32_MAX);
+        return false;
+    }
+    const uint32_t count = (uint32_t)hl->count;
+    sphere *spheres = hl->objects;
+
+    bvh_builder top = {spheres, NULL, 0, 0, chunkSize};
+    if (count > 0) {
+        Bvh_Build(&top, Bvh_AllocNodes(&top, 1), 0, count);
+    }
+
+    uint32_t chunkCount = 0;
+    for (uint32_t n = 0; n < top.nodeCount; ++n) {
+        chunkCount += top.nodes[n].count > 0;
+    }
+
+    FILE *fp = fopen(path, "wb");
+    if (fp == NULL) {
+        perror("fopen");
+        free(top.nodes);
+        return false;
+    }
+
+    scene_chunk *chunks =
+        (scene_chunk *)calloc(chunkCount ? chunkCount : 1, sizeof(scene_chunk));
+    size_t offset = ChunkedScene_AlignUp(
+        sizeof(chunked_scene_header) + top.nodeCount * sizeof(bvh_node) +
+        chunkCount * sizeof(scene_chunk));
+    size_t maxChunkBytes = 0;
+    bool ok = fseek(fp, (long)offset, SEEK_SET) == 0;
+
+    uint32_t chunkIndex = 0;
+    for (uint32_t n = 0; n < top.nodeCount && ok; ++n) {
+        bvh_node *leaf = &top.nodes[n];
+        if (leaf->count == 0) {
+            continue;
+        }
+        bvh_builder local = {&spheres[leaf->first], NULL, 0, 0,
+                             CHUNKED_SCENE_LEAF_SIZE};
+        Bvh_Build(&local, Bvh_AllocNodes(&local, 1), 0, leaf->count);
+
+        const size_t nodeBytes = local.nodeCount * sizeof(bvh_node);
+        const size_t sphereBytes = leaf->count * sizeof(sphere);
+        const size_t chunkBytes = ChunkedScene_AlignUp(nodeBytes + sphereBytes);
+        static const unsigned char padding[CHUNKED_SCENE_ALIGN] = {0};
+        ok = fwrite(local.nodes, 1, nodeBytes, fp) == nodeBytes &&
+             fwrite(local.spheres, 1, sphereBytes, fp) == sphereBytes &&
+             fwrite(padding, 1, chunkBytes - nodeBytes - sphereBytes, fp) ==
+                 chunkBytes - nodeBytes - sphereBytes;
+
+        chunks[chunkIndex] =
+            (scene_chunk){offset, local.nodeCount, leaf->count};
+        leaf->first = chunkIndex;
+        leaf->count = 1;
+        offset += chunkBytes;
+        if (chunkBytes > maxChunkBytes) {
+            maxChunkBytes = chunkBytes;
+        }
+        chunkIndex++;
+        free(local.nodes);
+    }
+
+    chunked_scene_header header;
+    memcpy(header.magic, CHUNKED_SCENE_MAGIC, sizeof(header.magic));
+    header.topNodeCount = top.nodeCount;
+    header.chunkCount = chunkCount;
+    header.maxChunkBytes = maxChunkBytes;
+    header.materialMask = Hittable_MaterialMask(hl);
+    header.reserved = 0;
+    ok = ok && fseek(fp, 0, SEEK_SET) == 0 &&
+         fwrite(&header, sizeof(header), 1, fp) == 1 &&
+         fwrite(top.nodes, sizeof(bvh_node), top.nodeCount, fp) ==
+             top.nodeCount &&
+         fwrite(chunks, sizeof(scene_chunk), chunkCount, fp) == chunkCount;
+    if (fclose(fp) != 0) {
+        ok = false;
+    }
+
+    free(chunks);
+    free(top.nodes);
+    return ok;
+}
+
+// Loading
+
+// Checks that a BVH read from a file only references nodes and items that
+// exist and is shallow enough for the traversal stacks. Children must come
+// after their parent, as Bvh_Build lays them out, which also rules out
+// cycles. Leaves hold items [first, first + count) of itemCount, in the
+// top-level BVH exactly one chunk each.
+static inline bool Bvh_Validate(const bvh_node *nodes, uint32_t nodeCount,
+                                uint32_t itemCount, bool chunkLeaves) {
+    if (nodeCount == 0) {
+        return false;
+    }
+    unsigned char *depth = (unsigned char *)calloc(nodeCount, 1);
+    bool ok = true;
+    for (uint32_t n = 0; n < nodeCount && ok; ++n) {
+        const bvh_node *node = &nodes[n];
+        if (node->count == 0) {
+            ok = node->first > n && node->first < nodeCount - 1 &&
+                 depth[n] + 2 < CHUNKED_SCENE_STACK_SIZE;
+            for (uint32_t c = node->first; ok && c <= node->first + 1; ++c) {
+                if (depth[c] < depth[n] + 1) {
+                    depth[c] = depth[n] + 1;
+                }
+            }
+        } else if (chunkLeaves) {
+            ok = node->count == 1 && node->first < itemCount;
+        } else {
+            ok = (uint64_t)node->first + node->count <= itemCount;
+        }
+    }
+    free(depth);
+    return ok;
+}
+
+static inline void FreeChunkedScene(chunked_scene *cs) {
+    munmap(cs->mapping, cs->mappingSize);
+    close(cs->fd);
+    free(cs->topNodes);
+    free(cs->chunks);
+    free(cs);
+}
+
+// Maps the scene file and copies the top-level structures into memory,
+// returns NULL if the file is missing or malformed. Every BVH in the file is
+// validated here, which reads the node arrays of all chunks once.
+static inline chunked_scene *OpenChunkedScene(const char *path) {
+    const int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 ||
+        (size_t)st.st_size < sizeof(chunked_scene_header)) {
+        close(fd);
+        return NULL;
+    }
+    const size_t size = (size_t)st.st_size;
+    unsigned char *mapping =
+        (unsigned char *)mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    if (mapping == MAP_FAILED) {
+        close(fd);
+        return NULL;
+    }
+    // chunks are visited in ray order, read-ahead would only pollute memory
+    madvise(mapping, size, MADV_RANDOM);
+
+    chunked_scene_header header;
+    memcpy(&header, mapping, sizeof(header));
+    const size_t topBytes = header.topNodeCount * sizeof(bvh_node);
+    const size_t chunkTableBytes = header.chunkCount * sizeof(scene_chunk);
+    if (memcmp(header.magic, CHUNKED_SCENE_MAGIC, sizeof(header.magic)) != 0 ||
+        sizeof(header) + topBytes + chunkTableBytes > size) {
+        munmap(mapping, size);
+        close(fd);
+        return NULL;
+    }
+
+    chunked_scene *cs = (chunked_scene *)malloc(sizeof(chunked_scene));
+    cs->fd = fd;
+    cs->mapping = mapping;
+    cs->mappingSize = size;
+    cs->topNodeCount = header.topNodeCount;
+    cs->chunkCount = header.chunkCount;
+    cs->maxChunkBytes = header.maxChunkBytes;
+    cs->materialMask = header.materialMask;
+    cs->topNodes = (bvh_node *)malloc(topBytes ? topBytes : 1);
+    memcpy(cs->topNodes, mapping + sizeof(header), topBytes);
+    cs->chunks = (scene_chunk *)malloc(chunkTableBytes ? chunkTableBytes : 1);
+    memcpy(cs->chunks, mapping + sizeof(header) + topBytes, chunkTableBytes);
+
+    bool valid = cs->maxChunkBytes <= size &&
+                 (cs->topNodeCount == 0 ||
+                  Bvh_Validate(cs->topNodes, cs->topNodeCount, cs->chunkCount,
+                               true));
+    for (uint32_t c = 0; c < cs->chunkCount && valid; ++c) {
+        const scene_chunk *chunk = &cs->chunks[c];
+        const size_t bytes = chunk->nodeCount * sizeof(bvh_node) +
+                             chunk->sphereCount * sizeof(sphere);
+        valid = chunk->offset % CHUNKED_SCENE_ALIGN == 0 &&
+                chunk->offset <= size && bytes <= size - chunk->offset &&
+                bytes <= cs->maxChunkBytes &&
+                Bvh_Validate((const bvh_node *)(mapping + chunk->offset),
+                             chunk->nodeCount, chunk->sphereCount, false);
+    }
+    if (!valid) {
+        FreeChunkedScene(cs);
+        return NULL;
+    }
+    return cs;
+}
+
+static inline chunk_cache *NewChunkCache(const chunked_scene *cs,
+                                         int slotCount) {
+    chunk_cache *cache = (chunk_cache *)malloc(sizeof(chunk_cache));
+    cache->scene = cs;
+    cache->slotCount = slotCount;
+    cache->slots = (unsigned char *)aligned_alloc(
+        CHUNKED_SCENE_ALIGN,
+        ChunkedScene_AlignUp(slotCount * cs->maxChunkBytes + 1));
+    cache->slotChunk = (uint32_t *)malloc(slotCount * sizeof(uint32_t));
+    cache->slotLastUse = (uint64_t *)calloc(slotCount, sizeof(uint64_t));
+    ChunkMap_Init(&cache->chunkSlot, (uint32_t)slotCount);
+    for (int s = 0; s < slotCount; ++s) {
+        cache->slotChunk[s] = UINT32_MAX;
+    }
+    cache->queues = NULL;
+    cache->queueCount = 0;
+    cache->queueCapacity = 0;
+    ChunkMap_Init(&cache->chunkQueue, 0);
+    cache->tick = 0;
+    cache->hits = 0;
+    cache->misses = 0;
+    return cache;
+}
+
+static inline void FreeChunkCache(chunk_cache *cache) {
+    free(cache->slots);
+    free(cache->slotChunk);
+    free(cache->slotLastUse);
+    ChunkMap_Free(&cache->chunkSlot);
+    free(cache->queues);
+    ChunkMap_Free(&cache->chunkQueue);
+    free(cache);
+}
+
+// Returns the chunk's nodes followed by its spheres, paging it in over the
+// least recently used slot if it isn't resident
+static inline unsigned char *ChunkCache_Get(chunk_cache *cache,
+                                            uint32_t chunkIndex) {
+    cache->tick++;
+    const int32_t *resident = ChunkMap_Find(&cache->chunkSlot, chunkIndex);
+    int slot;
+    if (resident != NULL) {
+        slot = *resident;
+        cache->hits++;
+    } else {
+        cache->misses++;
+        slot = 0;
+        for (int s = 1; s < cache->slotCount; ++s) {
+            if (cache->slotLastUse[s] < cache->slotLastUse[slot]) {
+                slot = s;
+            }
+        }
+        if (cache->slotChunk[slot] != UINT32_MAX) {
+            ChunkMap_Remove(&cache->chunkSlot, cache->slotChunk[slot]);
+        }
+        const scene_chunk *chunk = &cache->scene->chunks[chunkIndex];
+        memcpy(cache->slots + slot * cache->scene->maxChunkBytes,
+               cache->scene->mapping + chunk->offset,
+               chunk->nodeCount * sizeof(bvh_node) +
+                   chunk->sphereCount * sizeof(sphere));
+        cache->slotChunk[slot] = chunkIndex;
+        ChunkMap_Insert(&cache->chunkSlot, chunkIndex, slot);
+    }
+    cache->slotLastUse[slot] = cache->tick;
+    return cache->slots + slot * cache->scene->maxChunkBytes;
+}
+
+// Traversal
+
+// Tests a ray against one resident chunk, narrowing closestSoFar
+static inline bool ChunkedScene_HitChunk(const chunked_scene *cs,
+                                         unsigned char *data,
+                                         uint32_t chunkIndex, const ray *r,
+                                         const vec3 *invDir, const double tMin,
+                                         double *closestSoFar, hit_record *rec,
+                                         material *hitMaterial) {
+    const bvh_node *nodes = (const bvh_node *)data;
+    sphere *spheres =
+        (sphere *)(data + cs->chunks[chunkIndex].nodeCount * sizeof(bvh_node));
+
+    hit_record tempRec;
+    bool hitAnything = false;
+    uint32_t stack[CHUNKED_SCENE_STACK_SIZE];
+    int top = 0;
+    stack[top++] = 0;
+    while (top > 0) {
+        const bvh_node *node = &nodes[stack[--top]];
+        double tEnter;
+        if (!Aabb_Hit(&node->box, r, invDir, tMin, *closestSoFar, &tEnter)) {
+            continue;
+        }
+        if (node->count == 0) {
+            stack[top++] = node->first + 1;
+            stack[top++] = node->first;
+            continue;
+        }
+        for (uint32_t i = node->first; i < node->first + node->count; ++i) {
+            if (Sphere_Hit(&spheres[i], r, tMin, *closestSoFar, &tempRec)) {
+                hitAnything = true;
+                *closestSoFar = tempRec.t;
+                *rec = tempRec;
+                *hitMaterial = *tempRec.matPtr;
+                rec->matPtr = hitMaterial;
+            }
+        }
+    }
+    return hitAnything;
+}
+
+static inline void ChunkedScene_BeginQuery(const chunked_scene *cs,
+                                           chunk_query *q) {
+    q->invDir = Aabb_InvDirection(&q->r.direction);
+    q->hit = false;
+    q->top = 0;
+    if (cs->topNodeCount > 0) {
+        q->stack[q->top++] = 0;
+    }
+}
+
+// Walks the top-level BVH to the next chunk the ray enters before its
+// closest hit so far, returns UINT32_MAX when there is none. Nearer children
+// are visited first so farther chunks are usually culled before they have
+// to be paged in.
+static inline uint32_t ChunkedScene_NextChunk(const chunked_scene *cs,
+                                              chunk_query *q,
+                                              const double tMin) {
+    while (q->top > 0) {
+        const bvh_node *node = &cs->topNodes[q->stack[--q->top]];
+        double tEnter;
+        if (!Aabb_Hit(&node->box, &q->r, &q->invDir, tMin, q->tMax,
+                      &tEnter)) {
+            continue;
+        }
+        if (node->count > 0) {
+            return node->first;
+        }
+        double tLeft = q->tMax;
+        double tRight = q->tMax;
+        const bool hitLeft = Aabb_Hit(&cs->topNodes[node->first].box, &q->r,
+                                      &q->invDir, tMin, q->tMax, &tLeft);
+        const bool hitRight =
+            Aabb_Hit(&cs->topNodes[node->first + 1].box, &q->r, &q->invDir,
+                     tMin, q->tMax, &tRight);
+        if (hitLeft && hitRight && tRight < tLeft) {
+            q->stack[q->top++] = node->first;
+            q->stack[q->top++] = node->first + 1;
+        } else {
+            if (hitRight) {
+                q->stack[q->top++] = node->first + 1;
+            }
+            if (hitLeft) {
+                q->stack[q->top++] = node->first;
+            }
+        }
+    }
+    return UINT32_MAX;
+}
+
+static inline bool ChunkedScene_Hit(chunk_cache *cache, const ray *r,
+                                    const double tMin, const double tMax,
+                                    hit_record *rec) {
+    const chunked_scene *cs = cache->scene;
+    chunk_query q;
+    q.r = *r;
+    q.tMax = tMax;
+    ChunkedScene_BeginQuery(cs, &q);
+    uint32_t chunk;
+    while ((chunk = ChunkedScene_NextChunk(cs, &q, tMin)) != UINT32_MAX) {
+        unsigned char *data = ChunkCache_Get(cache, chunk);
+        q.hit |= ChunkedScene_HitChunk(cs, data, chunk, &q.r, &q.invDir, tMin,
+                                       &q.tMax, rec, &cache->hitMaterial);
+    }
+    return q.hit;
+}
+
+static inline void ChunkCache_Enqueue(chunk_cache *cache, chunk_query *queries,
+                                      int32_t index, uint32_t chunk) {
+    if (chunk == UINT32_MAX) {
+        return;
+    }
+    const int32_t *existing = ChunkMap_Find(&cache->chunkQueue, chunk);
+    int32_t queue;
+    if (existing != NULL) {
+        queue = *existing;
+    } else {
+        queue = (int32_t)cache->queueCount++;
+        cache->queues[queue] = (chunk_queue){chunk, -1, 0};
+        ChunkMap_Insert(&cache->chunkQueue, chunk, queue);
+    }
+    queries[index].next = cache->queues[queue].head;
+    cache->queues[queue].head = index;
+    cache->queues[queue].length++;
+}
+
+// Takes queue out of the set of waiting queues
+static inline chunk_queue ChunkCache_Dequeue(chunk_cache *cache,
+                                             uint32_t queue) {
+    const chunk_queue taken = cache->queues[queue];
+    ChunkMap_Remove(&cache->chunkQueue, taken.chunk);
+    if (queue != --cache->queueCount) {
+        cache->queues[queue] = cache->queues[cache->queueCount];
+        *ChunkMap_Find(&cache->chunkQueue, cache->queues[queue].chunk) =
+            (int32_t)queue;
+    }
+    return taken;
+}
+
+// Traces a batch of rays with one queue per chunk. Every ray waits on the
+// next chunk it enters and each chunk is paged in once for all rays waiting
+// on it, preferring chunks that are already resident and otherwise the
+// longest queue. Incoherent rays then share chunk loads instead of evicting
+// each other's chunks ray by ray. Results match ChunkedScene_Hit.
+static inline void ChunkedScene_HitQueued(chunk_cache *cache,
+                                          chunk_query *queries, int count,
+                                          const double tMin) {
+    const chunked_scene *cs = cache->scene;
+    if ((uint32_t)count > cache->queueCapacity) {
+        cache->queueCapacity = (uint32_t)count;
+        free(cache->queues);
+        cache->queues = (chunk_queue *)malloc(count * sizeof(chunk_queue));
+        ChunkMap_Free(&cache->chunkQueue);
+        ChunkMap_Init(&cache->chunkQueue, cache->queueCapacity);
+    }
+    for (int32_t i = 0; i < count; ++i) {
+        ChunkedScene_BeginQuery(cs, &queries[i]);
+        ChunkCache_Enqueue(cache, queries, i,
+                           ChunkedScene_NextChunk(cs, &queries[i], tMin));
+    }
+    while (cache->queueCount > 0) {
+        uint32_t best = 0;
+        bool bestResident = false;
+        for (uint32_t p = 0; p < cache->queueCount; ++p) {
+            const bool resident =
+                ChunkMap_Find(&cache->chunkSlot, cache->queues[p].chunk) !=
+                NULL;
+            if (p == 0 ||
+                (resident != bestResident
+                     ? resident
+                     : cache->queues[p].length > cache->queues[best].length)) {
+                best = p;
+                bestResident = resident;
+            }
+        }
+        const chunk_queue queue = ChunkCache_Dequeue(cache, best);
+
+        unsigned char *data = ChunkCache_Get(cache, queue.chunk);
+        for (int32_t index = queue.head; index >= 0;) {
+            chunk_query *q = &queries[index];
+            const int32_t next = q->next;
+            q->hit |= ChunkedScene_HitChunk(cs, data, queue.chunk, &q->r,
+                                            &q->invDir, tMin, &q->tMax, q->rec,
+                                            q->hitMaterial);
+            if (!(q->hit && q->anyHit)) {
+                ChunkCache_Enqueue(cache, queries, index,
+                                   ChunkedScene_NextChunk(cs, q, tMin));
+            }
+            index = next;
+        }
+    }
+}
+
+#endif
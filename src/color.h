@@ -3,18 +3,33 @@
 
 #include "vec3.h"
 
-#include <stdio.h>
+static inline double Color_Luminance(const color *c) {
+    return 0.2126 * c->e[0] + 0.7152 * c->e[1] + 0.0722 * c->e[2];
+}
+
+// Every pixel is written as "rrr ggg bbb\n" so its position in a P3 file can
+// be computed and rows can be written out of order
+#define COLOR_ENTRY_SIZE 12
+
+static inline void WriteComponent(char *out, int value) {
+    out[0] = value >= 100 ? (char)('0' + value / 100) : ' ';
+    out[1] = value >= 10 ? (char)('0' + value / 10 % 10) : ' ';
+    out[2] = (char)('0' + value % 10);
+}
 
-static inline void WriteColor(FILE *fp, color pixelColor, double colorScale) {
+static inline void WriteColor(char *out, color pixelColor, double colorScale) {
     static const int colorMax = 256;
     static const double colorMaxScaled = 0.999;
     Vec3_FMulAssign(&pixelColor, colorScale);
     const double r = sqrt(pixelColor.e[0]);
     const double g = sqrt(pixelColor.e[1]);
     const double b = sqrt(pixelColor.e[2]);
-    fprintf(fp, "%d %d %d\n", (int)(colorMax * Clamp(r, 0.0, colorMaxScaled)),
-            (int)(colorMax * Clamp(g, 0.0, colorMaxScaled)),
-            (int)(colorMax * Clamp(b, 0.0, colorMaxScaled)));
+    WriteComponent(out, (int)(colorMax * Clamp(r, 0.0, colorMaxScaled)));
+    out[3] = ' ';
+    WriteComponent(out + 4, (int)(colorMax * Clamp(g, 0.0, colorMaxScaled)));
+    out[7] = ' ';
+    WriteComponent(out + 8, (int)(colorMax * Clamp(b, 0.0, colorMaxScaled)));
+    out[11] = '\n';
 }
 
 #endif
\ No newline at end of file
@@ -6,6 +6,11 @@
 #include "vec3.h"
 #include "color.h"
 
+// Values of material.type
+#define MATERIAL_LAMBERTIAN 0
+#define MATERIAL_METAL 1
+#define MATERIAL_DIELECTRIC 2
+
 typedef struct material {
     int type;
     color albedo;
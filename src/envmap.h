@@ -0,0 +1,249 @@
+#ifndef ENVMAP_H
+#define ENVMAP_H
+
+#include <math.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "color.h"
+#include "rtweekend.h"
+#include "vec3.h"
+
+// HDR environment lighting from a lat-long Radiance .hdr image. Texels stay
+// in the file's shared-exponent RGBE form, 4 bytes each. A 2D distribution
+// (row marginal plus per-row conditional CDFs) over luminance x sin(theta)
+// lets bright regions such as the sun be sampled directly.
+//
+// +y is up, the top row of the image is straight up and the image wraps
+// around the y axis.
+
+// Largest map LoadEnvMap accepts, 32768 x 16384 takes 4 GiB with its
+// distribution
+#define ENV_MAP_MAX_TEXELS ((size_t)1 << 29)
+
+typedef struct env_map {
+    int width;
+    int height;
+    double scale;
+    unsigned char *rgbe;
+    // marginal[y] and conditional[y * width + x] are normalized CDFs
+    float *marginal;
+    float *conditional;
+    bool sampleable;
+} env_map;
+
+static inline color EnvMap_Texel(const env_map *m, int x, int y) {
+    const unsigned char *t = &m->rgbe[4 * ((size_t)y * m->width + x)];
+    if (t[3] == 0) {
+        return (color){{0.0, 0.0, 0.0}};
+    }
+    const double f = ldexp(1.0, (int)t[3] - (128 + 8)) * m->scale;
+    return (color){{(t[0] + 0.5) * f, (t[1] + 0.5) * f, (t[2] + 0.5) * f}};
+}
+
+// Reads one scanline in either the run-length encoded or the flat format
+static inline bool EnvMap_ReadScanline(FILE *fp, unsigned char *out,
+                                       int width) {
+    unsigned char head[4];
+    if (fread(head, 1, 4, fp) != 4) {
+        return false;
+    }
+    if (width < 8 || width > 0x7fff || head[0] != 2 || head[1] != 2 ||
+        (head[2] & 0x80)) {
+        memcpy(out, head, 4);
+        return fread(out + 4, 4, width - 1, fp) == (size_t)(width - 1);
+    }
+    if ((head[2] << 8 | head[3]) != width) {
+        return false;
+    }
+    // channels are stored one after another, each as runs and literals
+    for (int c = 0; c < 4; ++c) {
+        int x = 0;
+        while (x < width) {
+            int count = fgetc(fp);
+            if (count == EOF) {
+                return false;
+            }
+            if (count > 128) {
+                count -= 128;
+                const int value = fgetc(fp);
+                if (value == EOF || x + count > width) {
+                    return false;
+                }
+                while (count--) {
+                    out[4 * x++ + c] = (unsigned char)value;
+                }
+            } else {
+                if (count == 0 || x + count > width) {
+                    return false;
+                }
+                while (count--) {
+                    const int value = fgetc(fp);
+                    if (value == EOF) {
+                        return false;
+                    }
+                    out[4 * x++ + c] = (unsigned char)value;
+                }
+            }
+        }
+    }
+    return true;
+}
+
+static inline void FreeEnvMap(env_map *m) {
+    free(m->rgbe);
+    free(m->marginal);
+    free(m->conditional);
+    free(m);
+}
+
+// Builds the sampling distribution. Texels are weighted by sin(theta) since
+// rows near the poles cover less solid angle.
+static inline void EnvMap_BuildDistribution(env_map *m) {
+    const int w = m->width;
+    const int h = m->height;
+    double total = 0.0;
+    for (int y = 0; y < h; ++y) {
+        const double sinTheta = sin(Pi * (y + 0.5) / h);
+        float *row = &m->conditional[(size_t)y * w];
+        double rowSum = 0.0;
+        for (int x = 0; x < w; ++x) {
+            const color c = EnvMap_Texel(m, x, y);
+            rowSum += Color_Luminance(&c) * sinTheta;
+            row[x] = (float)rowSum;
+        }
+        for (int x = 0; x < w; ++x) {
+            row[x] = rowSum > 0.0 ? (float)(row[x] / rowSum)
+                                  : (float)(x + 1) / (float)w;
+        }
+        row[w - 1] = 1.0f;
+        total += rowSum;
+        m->marginal[y] = (float)total;
+    }
+    m->sampleable = total > 0.0;
+    for (int y = 0; y < h; ++y) {
+        m->marginal[y] = m->sampleable ? (float)(m->marginal[y] / total)
+                                       : (float)(y + 1) / (float)h;
+    }
+    m->marginal[h - 1] = 1.0f;
+}
+
+// Loads a Radiance .hdr file, returns NULL if it can't be read, is larger
+// than ENV_MAP_MAX_TEXELS or doesn't fit in memory
+static inline env_map *LoadEnvMap(const char *path, double scale) {
+    FILE *fp = fopen(path, "rb");
+    if (fp == NULL) {
+        return NULL;
+    }
+    char line[256];
+    bool rgbe = true;
+    if (fgets(line, sizeof(line), fp) == NULL || line[0] != '#' ||
+        line[1] != '?') {
+        fclose(fp);
+        return NULL;
+    }
+    while (fgets(line, sizeof(line), fp) != NULL && line[0] != '\n') {
+        if (strncmp(line, "FORMAT=", 7) == 0) {
+            rgbe = strncmp(line + 7, "32-bit_rle_rgbe", 15) == 0;
+        }
+    }
+    int width = 0;
+    int height = 0;
+    if (!rgbe || fgets(line, sizeof(line), fp) == NULL ||
+        sscanf(line, "-Y %d +X %d", &height, &width) != 2 || width <= 0 ||
+        height <= 0 || (size_t)width * height > ENV_MAP_MAX_TEXELS) {
+        fclose(fp);
+        return NULL;
+    }
+
+    env_map *m = (env_map *)malloc(sizeof(env_map));
+    if (m == NULL) {
+        fclose(fp);
+        return NULL;
+    }
+    m->width = width;
+    m->height = height;
+    m->scale = scale;
+    m->rgbe = (unsigned char *)malloc((size_t)width * height * 4);
+    m->marginal = (float *)malloc(height * sizeof(float));
+    m->conditional = (float *)malloc((size_t)width * height * sizeof(float));
+    if (m->rgbe == NULL || m->marginal == NULL || m->conditional == NULL) {
+        fclose(fp);
+        FreeEnvMap(m);
+        return NULL;
+    }
+    for (int y = 0; y < height; ++y) {
+        if (!EnvMap_ReadScanline(fp, &m->rgbe[(size_t)y * width * 4], width)) {
+            fclose(fp);
+            FreeEnvMap(m);
+            return NULL;
+        }
+    }
+    fclose(fp);
+    EnvMap_BuildDistribution(m);
+    return m;
+}
+
+static inline int EnvMap_Find(const float *cdf, int count, float u) {
+    int lo = 0;
+    int hi = count - 1;
+    while (lo < hi) {
+        const int mid = (lo + hi) / 2;
+        if (cdf[mid] <= u) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+static inline void EnvMap_Coordinates(const env_map *m, const vec3 *unitDir,
+                                      int *x, int *y) {
+    const double u = (atan2(unitDir->e[2], unitDir->e[0]) + Pi) / (2.0 * Pi);
+    const double v = acos(Clamp(unitDir->e[1], -1.0, 1.0)) / Pi;
+    *x = (int)(u * m->width);
+    *y = (int)(v * m->height);
+    *x = *x < 0 ? 0 : (*x >= m->width ? m->width - 1 : *x);
+    *y = *y < 0 ? 0 : (*y >= m->height ? m->height - 1 : *y);
+}
+
+static inline color EnvMap_Radiance(const env_map *m, const vec3 *unitDir) {
+    int x;
+    int y;
+    EnvMap_Coordinates(m, unitDir, &x, &y);
+    return EnvMap_Texel(m, x, y);
+}
+
+// Solid angle density of EnvMap_Sample
+static inline double EnvMap_Pdf(const env_map *m, const vec3 *unitDir) {
+    const double sinTheta =
+        sqrt(fmax(0.0, 1.0 - unitDir->e[1] * unitDir->e[1]));
+    if (!m->sampleable || sinTheta <= 0.0) {
+        return 0.0;
+    }
+    int x;
+    int y;
+    EnvMap_Coordinates(m, unitDir, &x, &y);
+    const float *row = &m->conditional[(size_t)y * m->width];
+    const double rowProbability =
+        y == 0 ? m->marginal[0] : m->marginal[y] - m->marginal[y - 1];
+    const double texelProbability = x == 0 ? row[0] : row[x] - row[x - 1];
+    return rowProbability * texelProbability * m->width * m->height /
+           (2.0 * Pi * Pi * sinTheta);
+}
+
+// Picks a direction proportionally to the map's brightness
+static inline vec3 EnvMap_Sample(const env_map *m) {
+    const int y = EnvMap_Find(m->marginal, m->height, (float)RandomDouble());
+    const int x = EnvMap_Find(&m->conditional[(size_t)y * m->width], m->width,
+                              (float)RandomDouble());
+    const double theta = Pi * (y + RandomDouble()) / m->height;
+    const double phi = 2.0 * Pi * (x + RandomDouble()) / m->width - Pi;
+    const double sinTheta = sin(theta);
+    return (vec3){{sinTheta * cos(phi), cos(theta), sinTheta * sin(phi)}};
+}
+
+#endif
@@ -0,0 +1,433 @@
+#ifndef GUIDING_H
+#define GUIDING_H
+
+#include <math.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "common.h"
+#include "material.h"
+#include "ray.h"
+#include "vec3.h"
+
+// Path guiding for diffuse bounces. Space is split into cubic cells, and
+// each cell further by the dominant axis of the surface normal, so points in
+// a cell face roughly the same way. Every cell learns a histogram of
+// incoming cosine weighted radiance over the hemisphere above the surface.
+// Training passes add to the histograms concurrently from all render
+// threads, then Guide_Update turns them into sampling distributions for the
+// next pass.
+//
+// Cells are numbered in the order they are first used and found through an
+// open addressing table keyed by their coordinates, so their data is packed
+// densely and a lookup touches one slot and one cache line of distribution.
+// Directions are binned in a tangent frame built from the normal by
+// (cos theta, phi), an equal-area mapping of the hemisphere, so every bin
+// covers the same solid angle and no guided direction points into the
+// surface.
+
+// table slots, twice the cells so probes stay short
+#define GUIDE_SLOTS 16384
+#define GUIDE_CELL_BITS 13
+#define GUIDE_MAX_CELLS (1 << GUIDE_CELL_BITS)
+#define GUIDE_Z_BINS 4
+// two azimuth bins per quadrant, see Guide_PhiBin
+#define GUIDE_PHI_BINS 8
+#define GUIDE_BINS (GUIDE_Z_BINS * GUIDE_PHI_BINS)
+#define GUIDE_MIN_SAMPLES 64
+// cumulative distributions are stored in 16 bits, one cell's fills a cache
+// line which is all a sample or density touches
+#define GUIDE_CDF_ONE 65535
+#define GUIDE_CDF_ALIGN 64
+#define GUIDE_EMPTY_SLOT 0
+
+typedef struct path_guide {
+    // reciprocal of the cell size
+    double cellScale;
+    // probability of sampling the learned distribution instead of the cosine
+    // lobe at a diffuse bounce
+    double guideFraction;
+    bool training;
+    // cell key shifted up by GUIDE_CELL_BITS over the cell's index, per slot
+    _Atomic uint64_t *slots;
+    // cells numbered so far, may overshoot GUIDE_MAX_CELLS
+    _Atomic uint32_t cellCount;
+    _Atomic double *radiance;
+    _Atomic uint32_t *samples;
+    // cumulative distribution per cell in units of 1 / GUIDE_CDF_ONE, only
+    // valid where ready is set
+    uint16_t *cdf;
+    bool *ready;
+} path_guide;
+
+// Tangent frame of a cell at a surface point, continuous in the normal as
+// long as its dominant axis stays the same
+typedef struct guide_frame {
+    vec3 tangent;
+    vec3 bitangent;
+    vec3 normal;
+} guide_frame;
+
+static inline path_guide *NewPathGuide(double cellSize, double guideFraction) {
+    path_guide *g = (path_guide *)malloc(sizeof(path_guide));
+    if (g == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    g->cellScale = 1.0 / cellSize;
+    g->guideFraction = guideFraction;
+    g->training = false;
+    atomic_init(&g->cellCount, 0);
+    g->slots = (_Atomic uint64_t *)malloc(GUIDE_SLOTS *
+                                          sizeof(_Atomic uint64_t));
+    g->radiance = (_Atomic double *)malloc(GUIDE_MAX_CELLS * GUIDE_BINS *
+                                           sizeof(_Atomic double));
+    g->samples = (_Atomic uint32_t *)malloc(GUIDE_MAX_CELLS *
+                                            sizeof(_Atomic uint32_t));
+    g->cdf = (uint16_t *)aligned_alloc(
+        GUIDE_CDF_ALIGN, GUIDE_MAX_CELLS * GUIDE_BINS * sizeof(uint16_t));
+    g->ready = (bool *)malloc(GUIDE_MAX_CELLS * sizeof(bool));
+    if (g->slots == NULL || g->radiance == NULL || g->samples == NULL ||
+        g->cdf == NULL || g->ready == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    for (int i = 0; i < GUIDE_SLOTS; ++i) {
+        atomic_init(&g->slots[i], GUIDE_EMPTY_SLOT);
+    }
+    for (int c = 0; c < GUIDE_MAX_CELLS; ++c) {
+        atomic_init(&g->samples[c], 0);
+        g->ready[c] = false;
+        for (int b = 0; b < GUIDE_BINS; ++b) {
+            atomic_init(&g->radiance[c * GUIDE_BINS + b], 0.0);
+        }
+    }
+    return g;
+}
+
+static inline void FreePathGuide(path_guide *g) {
+    free(g->slots);
+    free(g->radiance);
+    free(g->samples);
+    free(g->cdf);
+    free(g->ready);
+    free(g);
+}
+
+// Index of the normal's dominant axis times two, plus one if it is negative
+static inline int Guide_Orientation(const vec3 *normal) {
+    int axis = 0;
+    if (fabs(normal->e[1]) > fabs(normal->e[axis])) {
+        axis = 1;
+    }
+    if (fabs(normal->e[2]) > fabs(normal->e[axis])) {
+        axis = 2;
+    }
+    return 2 * axis + (normal->e[axis] < 0.0);
+}
+
+// Packs the cell coordinates, 15 bits each, and the orientation into a
+// non-zero key that leaves GUIDE_CELL_BITS free at the top. Coordinates wrap
+// far from the origin, which only makes distant cells share a distribution.
+static inline uint64_t Guide_Key(const path_guide *g, const point3 *p,
+                                 const vec3 *normal) {
+    uint64_t key = 1;
+    for (int a = 0; a < 3; ++a) {
+        const int64_t cell = (int64_t)floor(p->e[a] * g->cellScale);
+        key = key << 15 | ((uint64_t)cell & 0x7fff);
+    }
+    return key << 3 | (uint64_t)Guide_Orientation(normal);
+}
+
+static inline uint32_t Guide_Home(uint64_t key) {
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdull;
+    key ^= key >> 33;
+    return (uint32_t)(key & (GUIDE_SLOTS - 1));
+}
+
+static inline int Guide_SlotCell(uint64_t slot) {
+    return (int)(slot & (GUIDE_MAX_CELLS - 1));
+}
+
+// Returns the cell for key, -1 if it has none
+static inline int Guide_Find(const path_guide *g, uint64_t key) {
+    uint32_t i = Guide_Home(key);
+    for (;;) {
+        const uint64_t slot =
+            atomic_load_explicit(&g->slots[i], memory_order_relaxed);
+        if (slot >> GUIDE_CELL_BITS == key) {
+            return Guide_SlotCell(slot);
+        }
+        if (slot == GUIDE_EMPTY_SLOT) {
+            return -1;
+        }
+        i = (i + 1) & (GUIDE_SLOTS - 1);
+    }
+}
+
+// Guide_Find that numbers a new cell for a new key, safe from any number of
+// threads. Returns -1 once all GUIDE_MAX_CELLS are taken. Cells are numbered
+// before their slot is claimed so the slot never holds a key without one; a
+// thread that loses the race for a key wastes its number.
+static inline int Guide_Claim(path_guide *g, uint64_t key) {
+    if (atomic_load_explicit(&g->cellCount, memory_order_relaxed) >=
+        GUIDE_MAX_CELLS) {
+        return Guide_Find(g, key);
+    }
+    int cell = -1;
+    uint32_t i = Guide_Home(key);
+    for (;;) {
+        uint64_t slot =
+            atomic_load_explicit(&g->slots[i], memory_order_relaxed);
+        if (slot == GUIDE_EMPTY_SLOT) {
+            if (cell < 0) {
+                const uint32_t next = atomic_fetch_add_explicit(
+                    &g->cellCount, 1, memory_order_relaxed);
+                if (next >= GUIDE_MAX_CELLS) {
+                    return Guide_Find(g, key);
+                }
+                cell = (int)next;
+            }
+            // a failed exchange leaves the winner's slot in slot
+            if (atomic_compare_exchange_strong_explicit(
+                    &g->slots[i], &slot,
+                    key << GUIDE_CELL_BITS | (uint64_t)cell,
+                    memory_order_relaxed, memory_order_relaxed)) {
+                return cell;
+            }
+        }
+        if (slot >> GUIDE_CELL_BITS == key) {
+            return Guide_SlotCell(slot);
+        }
+        if (slot != GUIDE_EMPTY_SLOT) {
+            i = (i + 1) & (GUIDE_SLOTS - 1);
+        }
+    }
+}
+
+// Frame of Duff et al., "Building an Orthonormal Basis, Revisited", with the
+// dominant axis in place of z. Its one discontinuity is where that component
+// changes sign, which never happens within a cell.
+static inline guide_frame Guide_Frame(const vec3 *normal) {
+    const int orientation = Guide_Orientation(normal);
+    const int z = orientation / 2;
+    const int x = (z + 1) % 3;
+    const int y = (z + 2) % 3;
+    const double sign = (orientation & 1) ? -1.0 : 1.0;
+    const double nx = normal->e[x];
+    const double ny = normal->e[y];
+    const double a = -1.0 / (sign + normal->e[z]);
+    const double b = nx * ny * a;
+    guide_frame f = {{{0.0}}, {{0.0}}, *normal};
+    f.tangent.e[x] = 1.0 + sign * nx * nx * a;
+    f.tangent.e[y] = sign * b;
+    f.tangent.e[z] = -sign * nx;
+    f.bitangent.e[x] = b;
+    f.bitangent.e[y] = sign + ny * ny * a;
+    f.bitangent.e[z] = -ny;
+    return f;
+}
+
+// Azimuth bin of (x, y) in the tangent plane, counting from the tangent
+// towards the bitangent. Rotating into the first quadrant and comparing
+// against the diagonal there gives exactly the bins of atan2 at a fraction
+// of its cost.
+static inline int Guide_PhiBin(double x, double y) {
+    // selects rather than branches, directions come in random order
+    const bool lower = y < 0.0;
+    x = lower ? -x : x;
+    y = lower ? -y : y;
+    const bool left = x <= 0.0;
+    const double u = left ? y : x;
+    const double v = left ? -x : y;
+    return 4 * lower + 2 * left + (v >= u);
+}
+
+// Bin of a unit direction above the surface
+static inline int Guide_Bin(const guide_frame *f, const vec3 *unitDir) {
+    const double x = Vec3_Dot(unitDir, &f->tangent);
+    const double y = Vec3_Dot(unitDir, &f->bitangent);
+    const double z = Vec3_Dot(unitDir, &f->normal);
+    int zBin = (int)(z * GUIDE_Z_BINS);
+    zBin = zBin < 0 ? 0 : (zBin >= GUIDE_Z_BINS ? GUIDE_Z_BINS - 1 : zBin);
+    return zBin * GUIDE_PHI_BINS + Guide_PhiBin(x, y);
+}
+
+// Adds an estimate of the cosine weighted radiance arriving at surface point
+// p with the given normal from direction dir, i.e. the luminance divided by
+// the density dir was sampled with and multiplied by the cosine to the
+// normal. Safe to call from any number of threads.
+static inline void Guide_Record(path_guide *g, const point3 *p,
+                                const vec3 *normal, const vec3 *dir,
+                                double luminance) {
+    const vec3 unitDir = Vec3_UnitVector(dir);
+    if (Vec3_Dot(&unitDir, normal) <= 0.0) {
+        return;
+    }
+    const int cell = Guide_Claim(g, Guide_Key(g, p, normal));
+    if (cell < 0) {
+        return;
+    }
+    const guide_frame frame = Guide_Frame(normal);
+    _Atomic double *bin =
+        &g->radiance[cell * GUIDE_BINS + Guide_Bin(&frame, &unitDir)];
+    double expected = atomic_load_explicit(bin, memory_order_relaxed);
+    while (!atomic_compare_exchange_weak_explicit(
+        bin, &expected, expected + luminance, memory_order_relaxed,
+        memory_order_relaxed)) {
+    }
+    atomic_fetch_add_explicit(&g->samples[cell], 1, memory_order_relaxed);
+}
+
+// Rebuilds the sampling distributions from everything recorded so far. Must
+// not run concurrently with rendering.
+static inline void Guide_Update(path_guide *g) {
+    uint32_t cells =
+        atomic_load_explicit(&g->cellCount, memory_order_relaxed);
+    cells = cells < GUIDE_MAX_CELLS ? cells : GUIDE_MAX_CELLS;
+    for (uint32_t c = 0; c < cells; ++c) {
+        const _Atomic double *radiance = &g->radiance[c * GUIDE_BINS];
+        double total = 0.0;
+        for (int b = 0; b < GUIDE_BINS; ++b) {
+            total += radiance[b];
+        }
+        g->ready[c] = g->samples[c] >= GUIDE_MIN_SAMPLES && total > 0.0;
+        if (!g->ready[c]) {
+            continue;
+        }
+        // keep a small floor so no direction becomes impossible to guide into
+        const double floor = 0.01 * total / GUIDE_BINS;
+        const double scale = GUIDE_CDF_ONE / (total + GUIDE_BINS * floor);
+        double sum = 0.0;
+        uint16_t *cdf = &g->cdf[c * GUIDE_BINS];
+        int previous = 0;
+        for (int b = 0; b < GUIDE_BINS; ++b) {
+            sum += radiance[b] + floor;
+            // rounding must leave every bin at least one step, and room for
+            // the ones after it
+            int step = (int)lround(sum * scale);
+            if (step <= previous) {
+                step = previous + 1;
+            }
+            if (step > GUIDE_CDF_ONE - (GUIDE_BINS - 1 - b)) {
+                step = GUIDE_CDF_ONE - (GUIDE_BINS - 1 - b);
+            }
+            cdf[b] = (uint16_t)step;
+            previous = step;
+        }
+    }
+}
+
+// Distribution learned for a surface point and the frame its bins are in,
+// looked up once per bounce. cdf is NULL while there is none.
+typedef struct guide_lookup {
+    const uint16_t *cdf;
+    guide_frame frame;
+} guide_lookup;
+
+static inline guide_lookup Guide_Lookup(const path_guide *g,
+                                        const hit_record *rec) {
+    guide_lookup lookup = {NULL, {{{0.0}}, {{0.0}}, {{0.0}}}};
+    const int cell = Guide_Find(g, Guide_Key(g, &rec->p, &rec->normal));
+    if (cell >= 0 && g->ready[cell]) {
+        lookup.cdf = &g->cdf[cell * GUIDE_BINS];
+        lookup.frame = Guide_Frame(&rec->normal);
+    }
+    return lookup;
+}
+
+static inline double Guide_BinProbability(const uint16_t *cdf, int bin) {
+    return (bin == 0 ? cdf[0] : cdf[bin] - cdf[bin - 1]) /
+           (double)GUIDE_CDF_ONE;
+}
+
+// Solid angle density of the learned distribution, 0 below the surface
+static inline double Guide_Pdf(const uint16_t *cdf, const guide_frame *f,
+                               const vec3 *unitDir) {
+    if (Vec3_Dot(unitDir, &f->normal) <= 0.0) {
+        return 0.0;
+    }
+    return Guide_BinProbability(cdf, Guide_Bin(f, unitDir)) * GUIDE_BINS /
+           (2.0 * Pi);
+}
+
+static inline vec3 Guide_Sample(const uint16_t *cdf, const guide_frame *f) {
+    // u takes each of the GUIDE_CDF_ONE values below it equally often
+    const int u = (int)(RandomDouble() * GUIDE_CDF_ONE);
+    // first bin whose cdf exceeds u, in a fixed number of steps the compiler
+    // turns into conditional moves, random u defeats branch prediction
+    int bin = 0;
+    for (int step = GUIDE_BINS / 2; step > 0; step /= 2) {
+        bin += cdf[bin + step - 1] <= u ? step : 0;
+    }
+    const int zBin = bin / GUIDE_PHI_BINS;
+    const int phiBin = bin % GUIDE_PHI_BINS;
+    const double z = (zBin + RandomDouble()) / GUIDE_Z_BINS;
+    const double phi = 2.0 * Pi * (phiBin + RandomDouble()) / GUIDE_PHI_BINS;
+    const double r = sqrt(fmax(0.0, 1.0 - z * z));
+    const vec3 x = Vec3_FMul(&f->tangent, r * cos(phi));
+    const vec3 y = Vec3_FMul(&f->bitangent, r * sin(phi));
+    const vec3 zAxis = Vec3_FMul(&f->normal, z);
+    const vec3 xy = Vec3_Add(&x, &y);
+    return Vec3_Add(&xy, &zAxis);
+}
+
+// Solid angle density of Guide_ScatterLambertian picking unitDir
+static inline double Guide_LambertianPdf(const path_guide *g,
+                                         const guide_lookup *lookup,
+                                         const hit_record *rec,
+                                         const vec3 *unitDir) {
+    const double cosine = fmax(Vec3_Dot(unitDir, &rec->normal), 0.0);
+    if (lookup->cdf == NULL) {
+        return cosine / Pi;
+    }
+    return g->guideFraction *
+               Guide_Pdf(lookup->cdf, &lookup->frame, unitDir) +
+           (1.0 - g->guideFraction) * cosine / Pi;
+}
+
+// Lambertian scatter drawing from a mix of the learned distribution and the
+// cosine lobe, weighted by the mixture's density, which is returned in pdf.
+// Returns false only for a direction grazing the surface, which carries no
+// light.
+static inline bool Guide_ScatterLambertian(const path_guide *g,
+                                           const guide_lookup *lookup,
+                                           const material *l,
+                                           const hit_record *rec,
+                                           color *attenuation,
+                                           ray *scattered, double *pdf) {
+    if (lookup->cdf == NULL) {
+        Lambertian_Scatter(l, rec, attenuation, scattered);
+        const vec3 unitDir = Vec3_UnitVector(&scattered->direction);
+        *pdf = fmax(Vec3_Dot(&unitDir, &rec->normal), 0.0) / Pi;
+        return true;
+    }
+
+    vec3 direction;
+    if (RandomDouble() < g->guideFraction) {
+        direction = Guide_Sample(lookup->cdf, &lookup->frame);
+    } else {
+        const vec3 randomUnit = Vec3_RandomUnitVector();
+        direction = Vec3_Add(&rec->normal, &randomUnit);
+        if (Vec3_NearZero(&direction)) {
+            direction = rec->normal;
+        }
+        direction = Vec3_UnitVector(&direction);
+    }
+    const double cosine = Vec3_Dot(&direction, &rec->normal);
+    if (cosine <= 0.0) {
+        return false;
+    }
+    *pdf = g->guideFraction *
+               Guide_Pdf(lookup->cdf, &lookup->frame, &direction) +
+           (1.0 - g->guideFraction) * cosine / Pi;
+    *scattered = (ray){rec->p, direction};
+    *attenuation = Vec3_FMul(&l->albedo, cosine / (Pi * *pdf));
+    return true;
+}
+
+#endif
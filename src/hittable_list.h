@@ -2,6 +2,10 @@
 #define HITTABLE_LIST_H
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
 
 #include "hittable.h"
 #include "sphere.h"
@@ -9,7 +13,7 @@
 #define MAX_OBJECTS 1000
 
 typedef struct hittable_list {
-    int count;
+    size_t count;
     sphere objects[];
 } hittable_list;
 
@@ -19,10 +23,13 @@ static inline bool Hittable_Hit(hittable_list *hl, const ray *r,
     hit_record tempRec;
     bool hitAnything = false;
     double closestSoFar = tMax;
+    // local copy so writes through rec can't alias the ray and force it to
+    // be reloaded for every sphere
+    const ray localRay = *r;
 
-    register int i = hl->count + 1;
+    register size_t i = hl->count + 1;
     for (i = hl->count + 1; i--;) {
-        if (Sphere_Hit(&(hl->objects[i - 1]), r, tMin, closestSoFar,
+        if (Sphere_Hit(&(hl->objects[i - 1]), &localRay, tMin, closestSoFar,
                        &tempRec)) {
             hitAnything = true;
             closestSoFar = tempRec.t;
@@ -32,9 +39,13 @@ static inline bool Hittable_Hit(hittable_list *hl, const ray *r,
     return hitAnything;
 }
 
-static inline hittable_list *NewHittableList() {
+static inline hittable_list *NewHittableList(size_t capacity) {
     hittable_list *hl = (hittable_list *)malloc(sizeof(hittable_list) +
-                                                MAX_OBJECTS * sizeof(sphere));
+                                                capacity * sizeof(sphere));
+    if (hl == NULL) {
+        perror("malloc");
+        exit(1);
+    }
     hl->count = 0;
     return hl;
 }
@@ -44,4 +55,14 @@ static inline void Hittable_Add(hittable_list *hl, sphere object) {
     hl->count++;
 }
 
+// Bit (1 << type) is set for every material type used in the list
+static inline uint32_t Hittable_MaterialMask(const hittable_list *hl) {
+    uint32_t mask = 0;
+    for (size_t i = 0; i < hl->count; ++i) {
+        const int type = hl->objects[i].mat.type;
+        mask |= type >= 0 && type < 32 ? 1u << type : 1u;
+    }
+    return mask;
+}
+
 #endif
\ No newline at end of file
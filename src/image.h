@@ -0,0 +1,103 @@
+#ifndef IMAGE_H
+#define IMAGE_H
+
+#include <math.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+typedef struct image {
+    int width;
+    int height;
+    unsigned char *data;
+} image;
+
+static inline int Image_ReadToken(FILE *fp) {
+    int c = fgetc(fp);
+    while (c == '#' || c == ' ' || c == '\t' || c == '\n' || c == '\r') {
+        if (c == '#') {
+            while (c != '\n' && c != EOF) {
+                c = fgetc(fp);
+            }
+        }
+        c = fgetc(fp);
+    }
+    int value = 0;
+    if (c < '0' || c > '9') {
+        return -1;
+    }
+    while (c >= '0' && c <= '9') {
+        value = value * 10 + (c - '0');
+        c = fgetc(fp);
+    }
+    return value;
+}
+
+// Reads an 8-bit P3 or P6 image, returns NULL if the file can't be parsed
+static inline image *Image_ReadPPM(const char *path) {
+    FILE *fp = fopen(path, "rb");
+    if (fp == NULL) {
+        return NULL;
+    }
+    char magic[2];
+    if (fread(magic, 1, 2, fp) != 2 || magic[0] != 'P' ||
+        (magic[1] != '3' && magic[1] != '6')) {
+        fclose(fp);
+        return NULL;
+    }
+    const int width = Image_ReadToken(fp);
+    const int height = Image_ReadToken(fp);
+    const int maxValue = Image_ReadToken(fp);
+    if (width <= 0 || height <= 0 || maxValue != 255) {
+        fclose(fp);
+        return NULL;
+    }
+
+    image *img = (image *)malloc(sizeof(image));
+    img->width = width;
+    img->height = height;
+    const size_t count = (size_t)width * height * 3;
+    img->data = (unsigned char *)malloc(count);
+
+    bool ok = true;
+    if (magic[1] == '6') {
+        ok = fread(img->data, 1, count, fp) == count;
+    } else {
+        for (size_t i = 0; i < count && ok; ++i) {
+            const int value = Image_ReadToken(fp);
+            ok = value >= 0 && value <= maxValue;
+            img->data[i] = (unsigned char)value;
+        }
+    }
+    fclose(fp);
+    if (!ok) {
+        free(img->data);
+        free(img);
+        return NULL;
+    }
+    return img;
+}
+
+static inline void Image_Free(image *img) {
+    if (img != NULL) {
+        free(img->data);
+        free(img);
+    }
+}
+
+// Root mean square error over all channels in 0-255 units, or -1.0 if the
+// image dimensions differ
+static inline double Image_RMSE(const image *a, const image *b) {
+    if (a->width != b->width || a->height != b->height) {
+        return -1.0;
+    }
+    const size_t count = (size_t)a->width * a->height * 3;
+    double sum = 0.0;
+    for (size_t i = 0; i < count; ++i) {
+        const double d = (double)a->data[i] - (double)b->data[i];
+        sum += d * d;
+    }
+    return sqrt(sum / count);
+}
+
+#endif
@@ -0,0 +1,440 @@
+#ifndef KERNEL_H
+#define KERNEL_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "camera.h"
+#include "envmap.h"
+#include "guiding.h"
+#include "material.h"
+#include "ray.h"
+#include "scene.h"
+#include "vec3.h"
+
+// Render kernels specialized for the camera, the materials and the bounce
+// limit. Every function here takes a features bit mask which is a compile
+// time constant at each call site in KERNEL_VARIANTS, so branches for unused
+// features are removed from the hot loop. The matching variant is picked
+// once per render with Kernel_Features. Guiding, guide training and the
+// environment map are plain runtime branches.
+
+#define KERNEL_THIN_LENS (1 << 0)
+#define KERNEL_DIELECTRIC (1 << 1)
+#define KERNEL_FIXED_DEPTH (1 << 2)
+
+// Bounce limit baked into KERNEL_FIXED_DEPTH variants, whose bounce loops
+// have a constant trip count. Only used when --depth is exactly this value,
+// other depths, including the default of 50, run the variants with a
+// runtime limit.
+#define KERNEL_SHALLOW_DEPTH 8
+
+#define KERNEL_INLINE static inline __attribute__((always_inline))
+
+// Expands X(features) for every supported feature combination
+#define KERNEL_VARIANTS_DEPTH(X, f) X(f) X((f) | KERNEL_FIXED_DEPTH)
+#define KERNEL_VARIANTS_DIELECTRIC(X, f)                                       \
+    KERNEL_VARIANTS_DEPTH(X, f)                                                \
+    KERNEL_VARIANTS_DEPTH(X, (f) | KERNEL_DIELECTRIC)
+#define KERNEL_VARIANTS(X)                                                     \
+    KERNEL_VARIANTS_DIELECTRIC(X, 0)                                           \
+    KERNEL_VARIANTS_DIELECTRIC(X, KERNEL_THIN_LENS)
+
+// Rays traced by the calling thread, collected for the rays/sec report
+static _Thread_local uint64_t raysTraced = 0;
+
+static inline int Kernel_Features(const camera *cam, uint32_t materialMask,
+                                  int maxDepth) {
+    int features = 0;
+    if (cam->lensRadius > 0.0) {
+        features |= KERNEL_THIN_LENS;
+    }
+    if (materialMask & (1u << MATERIAL_DIELECTRIC)) {
+        features |= KERNEL_DIELECTRIC;
+    }
+    if (maxDepth == KERNEL_SHALLOW_DEPTH) {
+        features |= KERNEL_FIXED_DEPTH;
+    }
+    return features;
+}
+
+KERNEL_INLINE ray Kernel_GetRay(camera *c, double s, double t,
+                                const int features) {
+    if (features & KERNEL_THIN_LENS) {
+        return GetRay(c, s, t);
+    }
+    return (ray){c->origin,
+                 Vec3_Add5(c->lowerLeftCorner, Vec3_FMul(&c->horizontal, s),
+                           Vec3_FMul(&c->vertical, t), Vec3_Neg(&c->origin),
+                           (vec3){{0.0, 0.0, 0.0}})};
+}
+
+// Mat_Scatter with glass only checked for in scenes that have it, everything
+// else is Lambertian. Sets diffuse for Lambertian bounces, which are guided
+// when a guide is given. Guided bounces also keep the guide's lookup for
+// later densities and the density they were sampled with in pdf.
+KERNEL_INLINE bool Kernel_Scatter(const material *m, const ray *rayIn,
+                                  const hit_record *rec, color *attenuation,
+                                  ray *scattered, const path_guide *guide,
+                                  guide_lookup *lookup, double *pdf,
+                                  bool *diffuse, const int features) {
+    if (m->type == MATERIAL_METAL) {
+        return Metal_Scatter(m, rayIn, rec, attenuation, scattered);
+    }
+    if ((features & KERNEL_DIELECTRIC) && m->type == MATERIAL_DIELECTRIC) {
+        return Dielectric_Scatter(m, rayIn, rec, attenuation, scattered);
+    }
+    *diffuse = true;
+    if (guide != NULL) {
+        *lookup = Guide_Lookup(guide, rec);
+        return Guide_ScatterLambertian(guide, lookup, m, rec, attenuation,
+                                       scattered, pdf);
+    }
+    return Lambertian_Scatter(m, rec, attenuation, scattered);
+}
+
+static inline color Kernel_Background(const ray *r) {
+    const vec3 unitDirection = Vec3_UnitVector(&r->direction);
+    const double t = 0.5 * (unitDirection.e[1] + 1.0);
+
+    color bgColor1 = {{1.0, 1.0, 1.0}};
+    color bgColor2 = {{0.5, 0.7, 1.0}};
+    Vec3_FMulAssign(&bgColor1, (1.0 - t));
+    Vec3_FMulAssign(&bgColor2, t);
+    Vec3_AddAssign(&bgColor1, &bgColor2);
+    return bgColor1;
+}
+
+// Power heuristic weight for a sample drawn with density pdf when the other
+// strategy would have drawn it with density otherPdf
+static inline double Kernel_PowerHeuristic(double pdf, double otherPdf) {
+    const double a = pdf * pdf;
+    return a / (a + otherPdf * otherPdf);
+}
+
+// Density of a diffuse bounce scattering into unitDir
+static inline double Kernel_DiffusePdf(const path_guide *guide,
+                                       const guide_lookup *lookup,
+                                       const hit_record *rec,
+                                       const vec3 *unitDir) {
+    if (guide != NULL) {
+        return Guide_LambertianPdf(guide, lookup, rec, unitDir);
+    }
+    return fmax(Vec3_Dot(unitDir, &rec->normal), 0.0) / Pi;
+}
+
+// Light from the environment map along an escaping ray and its MIS weight.
+// bsdfPdf is the density the last diffuse bounce picked the ray with, or 0
+// when the ray comes from the camera or a specular bounce and the map was
+// not sampled.
+static inline color Kernel_Environment(const env_map *env, const ray *r,
+                                       double bsdfPdf, double *weight) {
+    const vec3 unitDirection = Vec3_UnitVector(&r->direction);
+    *weight = bsdfPdf > 0.0 ? Kernel_PowerHeuristic(
+                                  bsdfPdf, EnvMap_Pdf(env, &unitDirection))
+                            : 1.0;
+    return EnvMap_Radiance(env, &unitDirection);
+}
+
+typedef struct kernel_vertex {
+    point3 p;
+    vec3 normal;
+    vec3 direction;
+    color attenuation;
+    // light reaching the vertex through next event estimation, already
+    // multiplied by the surface's reflectance
+    color direct;
+    // cosine over the density the direction was sampled with, which turns
+    // the radiance found along it into an estimate that doesn't depend on
+    // the sampling distribution. 0 for vertices the guide doesn't learn at.
+    double recordWeight;
+} kernel_vertex;
+
+// A path between bounces. Each bounce is split around its two hit tests:
+// Kernel_PathShade runs once the path's ray has been intersected and may
+// ask for a shadow ray, Kernel_PathAdvance runs once that has been traced.
+// Kernel_RayColor runs both inline, Kernel_TraceBatch queues the hit tests
+// of many paths per scene chunk in between.
+typedef struct kernel_path {
+    ray r;
+    // hit of r, the material is copied here by batched chunk traversal
+    hit_record rec;
+    material hitMaterial;
+    color throughput;
+    color radiance;
+    color emitted;
+    double bsdfPdf;
+    int vertexCount;
+    kernel_vertex *vertices;
+    // generator state between the stages of batched paths
+    uint64_t randomState;
+    bool scatters;
+    bool diffuse;
+    // guide distribution at a diffuse hit and the density the scattered
+    // direction was picked with, only set when guiding
+    guide_lookup lookup;
+    double scatterPdf;
+    ray scattered;
+    color attenuation;
+    // next event estimation sample and the light it brings if unoccluded
+    bool shadowPending;
+    bool occluded;
+    ray shadow;
+    color unoccluded;
+    bool done;
+} kernel_path;
+
+// Seed for one camera sample, so its random numbers don't depend on the
+// order samples are traced in
+static inline uint64_t Kernel_SampleSeed(uint64_t seed, int row,
+                                         uint64_t sample) {
+    return (seed * 0x100000001B3ull + (uint64_t)row) * 0x100000001B3ull +
+           sample;
+}
+
+// Bounces a path takes at most, counting from 0. A compile time constant in
+// KERNEL_FIXED_DEPTH variants.
+KERNEL_INLINE int Kernel_MaxDepth(int maxDepth, const int features) {
+    return (features & KERNEL_FIXED_DEPTH) ? KERNEL_SHALLOW_DEPTH : maxDepth;
+}
+
+// Starts a path along r. While the guide is training every vertex is kept
+// in vertices, which needs room for maxDepth + 1 entries.
+KERNEL_INLINE void Kernel_PathBegin(kernel_path *path, const ray *r,
+                                    kernel_vertex *vertices) {
+    path->r = *r;
+    path->throughput = (color){{1.0, 1.0, 1.0}};
+    path->radiance = (color){{0.0, 0.0, 0.0}};
+    path->emitted = (color){{0.0, 0.0, 0.0}};
+    path->bsdfPdf = 0.0;
+    path->vertexCount = 0;
+    path->vertices = vertices;
+    path->done = false;
+}
+
+// Next event estimation at a diffuse vertex: one direction drawn from the
+// environment map and weighted against the bounce's own density. The light
+// only counts if the shadow ray turns out unoccluded.
+static inline void Kernel_SampleEnvironment(kernel_path *path,
+                                            const env_map *env,
+                                            const path_guide *guide) {
+    if (!env->sampleable) {
+        return;
+    }
+    const hit_record *rec = &path->rec;
+    const vec3 direction = EnvMap_Sample(env);
+    const double cosine = Vec3_Dot(&direction, &rec->normal);
+    const double lightPdf = EnvMap_Pdf(env, &direction);
+    if (cosine <= 0.0 || lightPdf <= 0.0) {
+        return;
+    }
+    raysTraced++;
+    const double bsdfPdf =
+        Kernel_DiffusePdf(guide, &path->lookup, rec, &direction);
+    const color radiance = EnvMap_Radiance(env, &direction);
+    path->shadowPending = true;
+    path->shadow = (ray){rec->p, direction};
+    path->unoccluded = Vec3_Mul(&rec->matPtr->albedo, &radiance);
+    Vec3_FMulAssign(&path->unoccluded,
+                    Kernel_PowerHeuristic(lightPdf, bsdfPdf) * cosine /
+                        (Pi * lightPdf));
+}
+
+// First half of a bounce, given whether the path's ray hit anything
+KERNEL_INLINE void Kernel_PathShade(kernel_path *path, bool hit,
+                                    const env_map *env,
+                                    const path_guide *guide,
+                                    const int features) {
+    raysTraced++;
+    path->scatters = false;
+    path->diffuse = false;
+    path->shadowPending = false;
+    if (hit) {
+        path->scatters = Kernel_Scatter(
+            path->rec.matPtr, &path->r, &path->rec, &path->attenuation,
+            &path->scattered, guide, &path->lookup, &path->scatterPdf,
+            &path->diffuse, features);
+        // rays leaving specular bounces, or absorbed by them and showing the
+        // background, are not weighted against the environment map
+        path->bsdfPdf = 0.0;
+    }
+    if (!path->scatters && !path->diffuse) {
+        if (env != NULL) {
+            double weight;
+            const color arriving =
+                Kernel_Environment(env, &path->r, path->bsdfPdf, &weight);
+            path->emitted = Vec3_FMul(&arriving, weight);
+        } else {
+            path->emitted = Kernel_Background(&path->r);
+        }
+        path->done = true;
+        return;
+    }
+    if (env != NULL && path->diffuse) {
+        Kernel_SampleEnvironment(path, env, guide);
+    }
+}
+
+// Second half of a bounce, given whether the shadow ray asked for by
+// Kernel_PathShade was blocked
+KERNEL_INLINE void Kernel_PathAdvance(kernel_path *path, bool occluded,
+                                      const env_map *env,
+                                      const path_guide *guide) {
+    const bool training = guide != NULL && guide->training;
+    color direct = {{0.0, 0.0, 0.0}};
+    if (path->shadowPending && !occluded) {
+        direct = path->unoccluded;
+    }
+    // a rejected guided direction carries no light, only the direct light
+    // at this vertex remains
+    if (!path->scatters) {
+        path->emitted = direct;
+        path->done = true;
+        return;
+    }
+    double recordWeight = 0.0;
+    if ((env != NULL || training) && path->diffuse) {
+        const vec3 unitDirection = Vec3_UnitVector(&path->scattered.direction);
+        const double cosine = Vec3_Dot(&unitDirection, &path->rec.normal);
+        path->bsdfPdf =
+            guide != NULL ? path->scatterPdf : fmax(cosine, 0.0) / Pi;
+        if (cosine > 0.0 && path->bsdfPdf > 0.0) {
+            recordWeight = cosine / path->bsdfPdf;
+        }
+        const color contribution = Vec3_Mul(&path->throughput, &direct);
+        Vec3_AddAssign(&path->radiance, &contribution);
+    }
+    if (training) {
+        path->vertices[path->vertexCount++] =
+            (kernel_vertex){path->rec.p, path->rec.normal,
+                            path->scattered.direction, path->attenuation,
+                            direct, recordWeight};
+    }
+    Vec3_MulAssign(&path->throughput, &path->attenuation);
+    path->r = path->scattered;
+}
+
+// Light carried by a finished path. While the guide is training this also
+// hands every vertex's incoming light to the guide.
+KERNEL_INLINE color Kernel_PathFinish(kernel_path *path, const env_map *env,
+                                      path_guide *guide) {
+    if (guide != NULL && guide->training) {
+        // walk back along the path to find the light arriving at each
+        // diffuse vertex, MIS weighted as in the pixel estimate so the guide
+        // learns what its bounces add on top of next event estimation
+        const kernel_vertex *vertices = path->vertices;
+        color incoming = path->emitted;
+        color outgoing = path->emitted;
+        for (int v = path->vertexCount - 1; v >= 0; --v) {
+            if (vertices[v].recordWeight > 0.0) {
+                Guide_Record(guide, &vertices[v].p, &vertices[v].normal,
+                             &vertices[v].direction,
+                             Color_Luminance(&incoming) *
+                                 vertices[v].recordWeight);
+            }
+            Vec3_MulAssign(&outgoing, &vertices[v].attenuation);
+            if (env != NULL) {
+                Vec3_AddAssign(&outgoing, &vertices[v].direct);
+            }
+            incoming = outgoing;
+        }
+    }
+    Vec3_MulAssign(&path->emitted, &path->throughput);
+    if (env != NULL) {
+        Vec3_AddAssign(&path->radiance, &path->emitted);
+        return path->radiance;
+    }
+    return path->emitted;
+}
+
+// Iterative form of the recursive Ray_Color, following the path while
+// multiplying up the attenuation. vertices is as for Kernel_PathBegin.
+KERNEL_INLINE color Kernel_RayColor(ray r, scene *world, path_guide *guide,
+                                    kernel_vertex *vertices,
+                                    const int maxDepth, const int features) {
+    const env_map *env = world->env;
+    kernel_path path;
+    Kernel_PathBegin(&path, &r, vertices);
+    const int depth = Kernel_MaxDepth(maxDepth, features);
+    for (int d = 0; d <= depth && !path.done; ++d) {
+        const bool hit = Scene_Hit(world, &path.r, 0.001, 99999.0, &path.rec);
+        Kernel_PathShade(&path, hit, env, guide, features);
+        if (path.done) {
+            break;
+        }
+        bool occluded = false;
+        if (path.shadowPending) {
+            // the shadow hit may reuse the chunk cache's material slot
+            // path.rec points to, the albedo was already read by then
+            hit_record shadowRec;
+            occluded =
+                Scene_Hit(world, &path.shadow, 0.001, 99999.0, &shadowRec);
+        }
+        Kernel_PathAdvance(&path, occluded, env, guide);
+    }
+    return Kernel_PathFinish(&path, env, guide);
+}
+
+// Runs count paths started with Kernel_PathBegin to completion in a chunked
+// scene, one bounce of all paths at a time, so their rays and shadow rays
+// can be queued per chunk by ChunkedScene_HitQueued. queries needs room for
+// count entries. Each path's generator state is swapped in around its own
+// stages, which keeps results identical to Kernel_RayColor.
+KERNEL_INLINE void Kernel_TraceBatch(kernel_path *paths, chunk_query *queries,
+                                     int count, scene *world,
+                                     path_guide *guide, const int maxDepth,
+                                     const int features) {
+    const env_map *env = world->env;
+    hit_record shadowRec;
+    material shadowMaterial;
+    const int depth = Kernel_MaxDepth(maxDepth, features);
+    for (int d = 0; d <= depth; ++d) {
+        int active = 0;
+        for (int k = 0; k < count; ++k) {
+            if (!paths[k].done) {
+                queries[active++] = (chunk_query){
+                    .r = paths[k].r,
+                    .tMax = 99999.0,
+                    .rec = &paths[k].rec,
+                    .hitMaterial = &paths[k].hitMaterial,
+                    .tag = (uint32_t)k,
+                };
+            }
+        }
+        if (active == 0) {
+            return;
+        }
+        ChunkedScene_HitQueued(world->cache, queries, active, 0.001);
+
+        int shadows = 0;
+        for (int q = 0; q < active; ++q) {
+            kernel_path *path = &paths[queries[q].tag];
+            const bool hit = queries[q].hit;
+            randomState = path->randomState;
+            Kernel_PathShade(path, hit, env, guide, features);
+            path->randomState = randomState;
+            path->occluded = false;
+            if (!path->done && path->shadowPending) {
+                queries[shadows++] = (chunk_query){
+                    .r = path->shadow,
+                    .tMax = 99999.0,
+                    .rec = &shadowRec,
+                    .hitMaterial = &shadowMaterial,
+                    .anyHit = true,
+                    .tag = queries[q].tag,
+                };
+            }
+        }
+        ChunkedScene_HitQueued(world->cache, queries, shadows, 0.001);
+        for (int q = 0; q < shadows; ++q) {
+            paths[queries[q].tag].occluded = queries[q].hit;
+        }
+        for (int k = 0; k < count; ++k) {
+            if (!paths[k].done) {
+                Kernel_PathAdvance(&paths[k], paths[k].occluded, env, guide);
+            }
+        }
+    }
+}
+
+#endif
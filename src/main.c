@@ -1,43 +1,32 @@
 #define _CRT_SECURE_NO_DEPRECATE
+#include <fcntl.h>
 #include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <string.h>
 #include <time.h>
+#include <unistd.h>
 
 #include "camera.h"
+#include "envmap.h"
+#include "guiding.h"
 #include "hittable.h"
 #include "hittable_list.h"
+#include "image.h"
+#include "kernel.h"
 #include "material.h"
 #include "ray.h"
+#include "scene.h"
 #include "sphere.h"
 #include "vec3.h"
 
-color Ray_Color(const ray *r, hittable_list *world, const int depth) {
-    if (depth < 0) {
-        return (color){{0.0, 0.0, 0.0}};
-    }
-    hit_record rec = {};
-    if (Hittable_Hit(world, r, 0.001, 99999.0, &rec)) {
-        ray scattered;
-        color attenuation;
-        if (Mat_Scatter(rec.matPtr, r, &rec, &attenuation, &scattered)) {
-            vec3 rc = Ray_Color(&scattered, world, depth - 1);
-            Vec3_MulAssign(&rc, &attenuation);
-            return rc;
-        }
-    }
-    const vec3 unitDirection = Vec3_UnitVector(&r->direction);
-    const double t = 0.5 * (unitDirection.e[1] + 1.0);
-
-    color bgColor1 = {{1.0, 1.0, 1.0}};
-    color bgColor2 = {{0.5, 0.7, 1.0}};
-    Vec3_FMulAssign(&bgColor1, (1.0 - t));
-    Vec3_FMulAssign(&bgColor2, t);
-    Vec3_AddAssign(&bgColor1, &bgColor2);
-    return bgColor1;
-}
-
-hittable_list *randomScene() {
-    hittable_list *world = NewHittableList();
+hittable_list *randomScene(const int extent) {
+    const size_t side = 2 * (size_t)extent;
+    const size_t capacity = side * side + 4;
+    hittable_list *world =
+        NewHittableList(capacity > MAX_OBJECTS ? capacity : MAX_OBJECTS);
 
     const material groundMaterial =
         NewMaterial(0, (color){{0.5, 0.5, 0.5}}, 0.0);
@@ -47,8 +36,8 @@ hittable_list *randomScene() {
 
     static const point3 maxDist = {{4, 0.2, 0}};
 
-    for (int a = -11; a < 11; a++) {
-        for (int b = -11; b < 11; b++) {
+    for (int a = -extent; a < extent; a++) {
+        for (int b = -extent; b < extent; b++) {
             const double chooseMat = RandomDouble();
             const point3 center = {{(double)a + 0.9 * RandomDouble(), 0.2,
                                     (double)b + 0.9 * RandomDouble()}};
@@ -95,19 +84,191 @@ hittable_list *randomScene() {
     return world;
 }
 
+typedef struct render_settings {
+    double aspectRatio;
+    int imageWidth;
+    int samplesPerPixel;
+    int maxDepth;
+    int threadCount;
+    uint64_t seed;
+    const char *outputPath;
+    int sceneExtent;
+    const char *scenePath;
+    const char *writeScenePath;
+    int chunkSize;
+    int chunkCacheSlots;
+    int stripRows;
+    double aperture;
+    int guidePasses;
+    int guideSamples;
+    double guideCellSize;
+    double guideFraction;
+    const char *envMapPath;
+    double envScale;
+    const char *referencePath;
+    double tolerance;
+    const char *baselinePath;
+    const char *recordBaselinePath;
+    double margin;
+    int runs;
+} render_settings;
+
+typedef struct render_stats {
+    double seconds;
+    uint64_t rays;
+    double variance;
+    uint64_t chunkHits;
+    uint64_t chunkMisses;
+} render_stats;
+
+// Render threads started once per render. Each job is a range of rows the
+// threads pull one at a time from a shared counter, so every thread stays
+// busy until the job runs out of rows however few rows a strip has.
+typedef struct render_pool {
+    pthread_barrier_t start;
+    pthread_barrier_t finish;
+    _Atomic int nextRow;
+    int stopRow;
+    int stripTop;
+    bool quit;
+} render_pool;
+
+typedef struct pixel_sum {
+    color color;
+    double luminanceSq;
+} pixel_sum;
+
 typedef struct thread_input {
+    render_pool *pool;
     int startRow;
     int stopRow;
     int imageWidth;
     int imageHeight;
     int samplesPerPixel;
     int maxDepth;
+    int features;
+    uint64_t seed;
+    uint64_t rays;
+    double varianceSum;
     camera *cam;
-    hittable_list *world;
+    scene world;
+    path_guide *guide;
+    kernel_vertex *vertices;
+    // paths in flight and their per-pixel sums for chunked scenes, which
+    // trace a row's samples RENDER_BATCH_SIZE at a time
+    kernel_path *paths;
+    chunk_query *queries;
+    color *rowColor;
+    double *rowLuminanceSq;
+    // formatted pixels of the current strip, which starts at output row
+    // stripTop, NULL for guide training passes
+    char *outData;
+    int stripTop;
+    // while guiding, the strip's per-pixel sums of all passes so far and the
+    // samples per pixel the training passes added to them
+    pixel_sum *sums;
+    int trainingSamples;
 } thread_input;
 
-void *renderPixel(void *arg) {
-    thread_input *tdata = (thread_input *)arg;
+// Paths traced together in chunked scenes, enough for the rays waiting on
+// a chunk to share its load
+#define RENDER_BATCH_SIZE 1024
+
+// Finishes pixel (i, j) from the sum of its samples' colors and squared
+// luminances. While guiding the samples are added to the strip's sums, which
+// the final pass writes out, so training samples count towards the image.
+static inline void RenderRows_FinishPixel(thread_input *tdata, int i, int j,
+                                          color pixelColor,
+                                          double luminanceSq) {
+    const size_t index =
+        (size_t)(tdata->imageHeight - j - 1 - tdata->stripTop) *
+            tdata->imageWidth +
+        i;
+    int samplesPerPixel = tdata->samplesPerPixel;
+    if (tdata->sums != NULL) {
+        pixel_sum *sum = &tdata->sums[index];
+        Vec3_AddAssign(&sum->color, &pixelColor);
+        sum->luminanceSq += luminanceSq;
+        pixelColor = sum->color;
+        luminanceSq = sum->luminanceSq;
+        samplesPerPixel += tdata->trainingSamples;
+    }
+    if (tdata->outData == NULL) {
+        return;
+    }
+    const double colorScale = 1.0 / samplesPerPixel;
+    // variance of the pixel estimate, from the sample variance
+    if (samplesPerPixel > 1) {
+        const double mean = Color_Luminance(&pixelColor) * colorScale;
+        const double sampleVariance =
+            (luminanceSq * colorScale - mean * mean) * samplesPerPixel /
+            (samplesPerPixel - 1);
+        tdata->varianceSum += sampleVariance * colorScale;
+    }
+    WriteColor(tdata->outData + index * COLOR_ENTRY_SIZE, pixelColor,
+               colorScale);
+}
+
+// Row loop for chunked scenes. A row's samples are traced in batches with
+// Kernel_TraceBatch so rays and shadow rays are queued per chunk, the image
+// is the same as RenderRowsKernel's.
+KERNEL_INLINE void RenderRowsBatched(thread_input *tdata, const int features) {
+    const int width = tdata->imageWidth;
+    const int height = tdata->imageHeight;
+    const int samplesPerPixel = tdata->samplesPerPixel;
+    const int maxDepth = tdata->maxDepth;
+    const uint64_t sampleCount = (uint64_t)width * samplesPerPixel;
+    kernel_path *paths = tdata->paths;
+
+    raysTraced = 0;
+    for (int j = tdata->startRow; j < tdata->stopRow; ++j) {
+        for (int i = 0; i < width; ++i) {
+            tdata->rowColor[i] = (color){{0.0, 0.0, 0.0}};
+            tdata->rowLuminanceSq[i] = 0.0;
+        }
+        for (uint64_t first = 0; first < sampleCount;
+             first += RENDER_BATCH_SIZE) {
+            const int count = sampleCount - first < RENDER_BATCH_SIZE
+                                  ? (int)(sampleCount - first)
+                                  : RENDER_BATCH_SIZE;
+            for (int k = 0; k < count; ++k) {
+                const int i = (int)((first + k) / samplesPerPixel);
+                SeedRandom(Kernel_SampleSeed(tdata->seed, j, first + k));
+                const double u = (i + RandomDouble()) / (width - 1);
+                const double v = (j + RandomDouble()) / (height - 1);
+                const ray r = Kernel_GetRay(tdata->cam, u, v, features);
+                kernel_vertex *vertices =
+                    tdata->vertices == NULL
+                        ? NULL
+                        : tdata->vertices + (size_t)k * (maxDepth + 1);
+                Kernel_PathBegin(&paths[k], &r, vertices);
+                paths[k].randomState = randomState;
+            }
+            Kernel_TraceBatch(paths, tdata->queries, count, &tdata->world,
+                              tdata->guide, maxDepth, features);
+            for (int k = 0; k < count; ++k) {
+                const int i = (int)((first + k) / samplesPerPixel);
+                const color rayColor = Kernel_PathFinish(
+                    &paths[k], tdata->world.env, tdata->guide);
+                Vec3_AddAssign(&tdata->rowColor[i], &rayColor);
+                const double luminance = Color_Luminance(&rayColor);
+                tdata->rowLuminanceSq[i] += luminance * luminance;
+            }
+        }
+        for (int i = 0; i < width; ++i) {
+            RenderRows_FinishPixel(tdata, i, j, tdata->rowColor[i],
+                                   tdata->rowLuminanceSq[i]);
+        }
+    }
+    tdata->rays += raysTraced;
+}
+
+// The row loop shared by all kernel variants
+KERNEL_INLINE void RenderRowsKernel(thread_input *tdata, const int features) {
+    if (tdata->world.cache != NULL) {
+        RenderRowsBatched(tdata, features);
+        return;
+    }
 
     const int width = tdata->imageWidth;
     const int height = tdata->imageHeight;
@@ -119,126 +280,606 @@ void *renderPixel(void *arg) {
     register int j = start;
     register int i = 0;
     register int s = 0;
-    register int index = 0;
-
-    color *outData = (color *)malloc(((stop - start) * width) * sizeof(color));
 
+    raysTraced = 0;
     for (j = start; j < stop; ++j) {
         for (i = 0; i < width; ++i) {
             color pixelColor = (color){{0.0, 0.0, 0.0}};
+            double luminanceSq = 0.0;
             for (s = samplesPerPixel; s; s--) {
+                // seed per sample so the image doesn't depend on the thread
+                // count or on how samples are batched
+                SeedRandom(Kernel_SampleSeed(
+                    tdata->seed, j,
+                    (uint64_t)i * samplesPerPixel + (samplesPerPixel - s)));
                 const double u = (i + RandomDouble()) / (width - 1);
                 const double v = (j + RandomDouble()) / (height - 1);
-                const ray r = GetRay(tdata->cam, u, v);
-                const vec3 rayColor = Ray_Color(&r, tdata->world, maxDepth);
+                const ray r = Kernel_GetRay(tdata->cam, u, v, features);
+                const vec3 rayColor = Kernel_RayColor(
+                    r, &tdata->world, tdata->guide, tdata->vertices, maxDepth,
+                    features);
                 Vec3_AddAssign(&pixelColor, &rayColor);
+                const double luminance = Color_Luminance(&rayColor);
+                luminanceSq += luminance * luminance;
             }
-            outData[index] = pixelColor;
-            index++;
+            RenderRows_FinishPixel(tdata, i, j, pixelColor, luminanceSq);
+        }
+    }
+    tdata->rays += raysTraced;
+}
+
+static void RenderRowsVariant(thread_input *tdata) {
+    switch (tdata->features) {
+#define RENDER_KERNEL_CASE(features)                                           \
+    case features:                                                             \
+        RenderRowsKernel(tdata, features);                                     \
+        break;
+        KERNEL_VARIANTS(RENDER_KERNEL_CASE)
+#undef RENDER_KERNEL_CASE
+    default:
+        fprintf(stderr, "No render kernel for features %d\n", tdata->features);
+        exit(1);
+    }
+}
+
+// Render thread: waits for a job, renders rows until the job has none left
+// and waits for the next one
+void *renderPixel(void *arg) {
+    thread_input *tdata = (thread_input *)arg;
+    render_pool *pool = tdata->pool;
+
+    for (;;) {
+        pthread_barrier_wait(&pool->start);
+        if (pool->quit) {
+            break;
+        }
+        tdata->stripTop = pool->stripTop;
+        int row;
+        while ((row = atomic_fetch_add_explicit(&pool->nextRow, 1,
+                                                memory_order_relaxed)) <
+               pool->stopRow) {
+            tdata->startRow = row;
+            tdata->stopRow = row + 1;
+            RenderRowsVariant(tdata);
+        }
+        pthread_barrier_wait(&pool->finish);
+    }
+    return NULL;
+}
+
+static double MonotonicSeconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+static void WriteAll(int fd, const char *data, size_t size, off_t offset) {
+    while (size > 0) {
+        const ssize_t written = pwrite(fd, data, size, offset);
+        if (written < 0) {
+            perror("pwrite");
+            exit(1);
         }
+        data += written;
+        size -= (size_t)written;
+        offset += written;
     }
-    pthread_exit(outData);
-    return outData;
 }
 
-void Render() {
+// Renders rows [firstRow, firstRow + rows) on the pool's threads
+static void RenderRows(render_pool *pool, const int firstRow, const int rows,
+                       const int stripTop) {
+    atomic_store(&pool->nextRow, firstRow);
+    pool->stopRow = firstRow + rows;
+    pool->stripTop = stripTop;
+    pthread_barrier_wait(&pool->start);
+    pthread_barrier_wait(&pool->finish);
+}
+
+void Render(const render_settings *settings, render_stats *stats) {
 
     // Settings
-    const double aspectRatio = 3.0 / 2.0;
-    const int imageWidth = 600;
+    const double aspectRatio = settings->aspectRatio;
+    const int imageWidth = settings->imageWidth;
     const int imageHeight = (int)(imageWidth / aspectRatio);
-    const int samplesPerPixel = 100;
-    const double colorScale = 1.0 / samplesPerPixel;
-    const int maxDepth = 50;
+    const int samplesPerPixel = settings->samplesPerPixel;
+    const int maxDepth = settings->maxDepth;
+    int stripRows = settings->stripRows;
+    if (stripRows <= 0 || stripRows > imageHeight) {
+        stripRows = imageHeight;
+    }
 
     // Create World
-    hittable_list *world = randomScene();
+    hittable_list *world = NULL;
+    chunked_scene *chunked = NULL;
+    if (settings->scenePath != NULL) {
+        if ((chunked = OpenChunkedScene(settings->scenePath)) == NULL) {
+            fprintf(stderr, "Could not open scene %s\n", settings->scenePath);
+            exit(1);
+        }
+    } else {
+        SeedRandom(settings->seed);
+        world = randomScene(settings->sceneExtent);
+    }
 
     // Camera
     const vec3 lookfrom = {{13, 2, 3}};
     const vec3 lookat = {{0, 0, 0}};
     const vec3 vup = {{0, 1, 0}};
     const double distToFocus = 10.0;
-    const double aperture = 0.1;
+    const double aperture = settings->aperture;
     camera *cam = NewCamera(lookfrom, lookat, vup, 20, aspectRatio, aperture,
                             distToFocus);
 
-    // Multi-threaded rendering
-    const int threadCount = 100;
+    // Environment lighting
+    env_map *env = NULL;
+    if (settings->envMapPath != NULL) {
+        env = LoadEnvMap(settings->envMapPath, settings->envScale);
+        if (env == NULL) {
+            fprintf(stderr, "Could not load environment map %s\n",
+                    settings->envMapPath);
+            exit(1);
+        }
+    }
+
+    // Path guiding
+    path_guide *guide = NULL;
+    if (settings->guidePasses > 0) {
+        guide = NewPathGuide(settings->guideCellSize, settings->guideFraction);
+    }
+
+    // Output file, filled in strip by strip with positional writes
+    const int fd =
+        open(settings->outputPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        perror("open");
+        exit(1);
+    }
+    char header[64];
+    const int headerSize = snprintf(header, sizeof(header), "P3\n%d %d\n255\n",
+                                    imageWidth, imageHeight);
+    WriteAll(fd, header, (size_t)headerSize, 0);
+
+    const size_t rowBytes = (size_t)imageWidth * COLOR_ENTRY_SIZE;
+    char *stripData = (char *)malloc(rowBytes * stripRows);
+    const size_t sumBytes = (size_t)imageWidth * stripRows * sizeof(pixel_sum);
+    pixel_sum *sums = guide != NULL ? (pixel_sum *)malloc(sumBytes) : NULL;
+    if (stripData == NULL || (guide != NULL && sums == NULL)) {
+        perror("malloc");
+        exit(1);
+    }
+
+    // Multi-threaded rendering, the threads and their chunk caches are
+    // started once and reused for the training passes and every strip
+    const int threadCount = settings->threadCount;
     pthread_t tid[threadCount];
     thread_input td[threadCount];
+    render_pool pool;
+    pthread_barrier_init(&pool.start, NULL, (unsigned)threadCount + 1);
+    pthread_barrier_init(&pool.finish, NULL, (unsigned)threadCount + 1);
+    pool.quit = false;
+
+    // Pick the kernel variant matching the scene
+    const uint32_t materialMask = chunked != NULL
+                                      ? chunked->materialMask
+                                      : Hittable_MaterialMask(world);
+    const int features = Kernel_Features(cam, materialMask, maxDepth);
+
     for (int t = 0; t < threadCount; ++t) {
 
+        td[t].pool = &pool;
         td[t].imageWidth = imageWidth;
         td[t].imageHeight = imageHeight;
         td[t].samplesPerPixel = samplesPerPixel;
         td[t].maxDepth = maxDepth;
-
-        td[t].startRow = t * (imageHeight / threadCount);
-        td[t].stopRow = (t + 1) * (imageHeight / threadCount);
-        if (td[t].stopRow > (imageWidth * imageHeight)) {
-            td[t].stopRow = imageWidth * imageHeight;
-        }
+        td[t].features = features;
+        td[t].seed = settings->seed;
+        td[t].rays = 0;
+        td[t].varianceSum = 0.0;
         td[t].cam = cam;
-        td[t].world = world;
-        pthread_create(&(tid[t]), NULL, renderPixel, (void *)&(td[t]));
+        td[t].world.list = world;
+        td[t].world.cache =
+            chunked != NULL ? NewChunkCache(chunked, settings->chunkCacheSlots)
+                            : NULL;
+        td[t].world.env = env;
+        td[t].guide = guide;
+        td[t].vertices = NULL;
+        td[t].paths = NULL;
+        td[t].queries = NULL;
+        td[t].rowColor = NULL;
+        td[t].rowLuminanceSq = NULL;
+        if (chunked != NULL) {
+            td[t].paths = (kernel_path *)malloc(RENDER_BATCH_SIZE *
+                                                sizeof(kernel_path));
+            td[t].queries = (chunk_query *)malloc(RENDER_BATCH_SIZE *
+                                                  sizeof(chunk_query));
+            td[t].rowColor = (color *)malloc(imageWidth * sizeof(color));
+            td[t].rowLuminanceSq =
+                (double *)malloc(imageWidth * sizeof(double));
+        }
     }
 
-    color *pixelColorArray =
-        (color *)malloc(sizeof(color) * imageWidth * imageHeight);
+    for (int t = 0; t < threadCount; ++t) {
+        pthread_create(&tid[t], NULL, renderPixel, (void *)&td[t]);
+    }
+
+    stats->seconds = 0.0;
 
-    // collect the results
+    // Path vertices are only kept during training, batched paths each need
+    // their own
+    const size_t pathCount = chunked != NULL ? RENDER_BATCH_SIZE : 1;
+    const size_t vertexBytes =
+        pathCount * (maxDepth + 1) * sizeof(kernel_vertex);
     for (int t = 0; t < threadCount; ++t) {
-        color *temp = NULL;
-        pthread_join(tid[t], (void **)&temp);
-
-        const int start = td[t].startRow;
-        const int stop = td[t].stopRow;
-
-        int index = 0;
-        for (int j = start; j < stop; ++j) {
-            for (int i = 0; i < imageWidth; ++i) {
-                const int invJ = imageHeight - j - 1;
-                const int imageIndex = imageWidth * invJ + i;
-                pixelColorArray[imageIndex] = temp[index];
-                index++;
+        td[t].sums = sums;
+        td[t].trainingSamples = settings->guidePasses * settings->guideSamples;
+    }
+
+    for (int stripTop = 0; stripTop < imageHeight; stripTop += stripRows) {
+        const int stripBottom = stripTop + stripRows < imageHeight
+                                    ? stripTop + stripRows
+                                    : imageHeight;
+        const int rows = stripBottom - stripTop;
+        // output rows [stripTop, stripBottom) are rendered rows
+        // [firstRow, firstRow + rows)
+        const int firstRow = imageHeight - stripBottom;
+
+        const double startTime = MonotonicSeconds();
+        // Guide training passes over the strip at a low sample count, the
+        // distributions are rebuilt after every pass. The guide keeps what
+        // earlier strips taught it.
+        if (guide != NULL) {
+            memset(sums, 0, sumBytes);
+            guide->training = true;
+            for (int t = 0; t < threadCount; ++t) {
+                td[t].vertices = (kernel_vertex *)malloc(vertexBytes);
+                if (td[t].vertices == NULL) {
+                    perror("malloc");
+                    exit(1);
+                }
+                td[t].samplesPerPixel = settings->guideSamples;
+                td[t].outData = NULL;
+            }
+            for (int pass = 0; pass < settings->guidePasses; ++pass) {
+                for (int t = 0; t < threadCount; ++t) {
+                    td[t].seed = settings->seed ^ ((uint64_t)(pass + 1) << 32);
+                }
+                RenderRows(&pool, firstRow, rows, stripTop);
+                Guide_Update(guide);
+            }
+            guide->training = false;
+            for (int t = 0; t < threadCount; ++t) {
+                free(td[t].vertices);
+                td[t].vertices = NULL;
             }
         }
-
-        if (temp != NULL) {
-            free(temp);
+        for (int t = 0; t < threadCount; ++t) {
+            td[t].samplesPerPixel = samplesPerPixel;
+            td[t].seed = settings->seed;
+            td[t].outData = stripData;
         }
+        RenderRows(&pool, firstRow, rows, stripTop);
+        stats->seconds += MonotonicSeconds() - startTime;
+
+        WriteAll(fd, stripData, rowBytes * rows,
+                 (off_t)headerSize + (off_t)rowBytes * stripTop);
     }
 
-    // output to file
-    FILE *file = NULL;
-    if ((file = fopen("output.ppm", "w+")) == NULL) {
-        perror("fopen");
+    pool.quit = true;
+    pthread_barrier_wait(&pool.start);
+    for (int t = 0; t < threadCount; ++t) {
+        pthread_join(tid[t], NULL);
+    }
+    pthread_barrier_destroy(&pool.start);
+    pthread_barrier_destroy(&pool.finish);
+
+    if (close(fd) != 0) {
+        perror("close");
         exit(1);
     }
-    fprintf(file, "P3\n%d %d\n255\n", imageWidth, imageHeight);
-    for (int i = 0; i < imageWidth * imageHeight; ++i) {
-        WriteColor(file, pixelColorArray[i], colorScale);
+
+    // collect the statistics
+    stats->rays = 0;
+    stats->variance = 0.0;
+    stats->chunkHits = 0;
+    stats->chunkMisses = 0;
+    for (int t = 0; t < threadCount; ++t) {
+        stats->rays += td[t].rays;
+        stats->variance += td[t].varianceSum;
+        if (td[t].world.cache != NULL) {
+            stats->chunkHits += td[t].world.cache->hits;
+            stats->chunkMisses += td[t].world.cache->misses;
+            FreeChunkCache(td[t].world.cache);
+        }
+        free(td[t].paths);
+        free(td[t].queries);
+        free(td[t].rowColor);
+        free(td[t].rowLuminanceSq);
     }
-    fclose(file);
 
-    free(pixelColorArray);
+    stats->variance /= (double)imageWidth * imageHeight;
+
+    free(stripData);
+    free(sums);
+    if (env != NULL) {
+        FreeEnvMap(env);
+    }
+    if (guide != NULL) {
+        FreePathGuide(guide);
+    }
     free(cam);
     free(world);
+    if (chunked != NULL) {
+        FreeChunkedScene(chunked);
+    }
+}
+
+// Compares the rendered image against a stored reference and the measured
+// rays/sec against a recorded baseline. Returns false if either check fails.
+static bool CheckRegression(const render_settings *settings,
+                            const render_stats *stats) {
+    bool passed = true;
+    const double raysPerSec = stats->rays / stats->seconds;
+    printf("Traced %llu rays in %f seconds (%.0f rays/sec).\n",
+           (unsigned long long)stats->rays, stats->seconds, raysPerSec);
+    // lower variance x time means faster convergence, comparable between
+    // runs with different settings
+    printf("Mean pixel variance %g, variance x time %g.\n", stats->variance,
+           stats->variance * stats->seconds);
+    if (settings->scenePath != NULL) {
+        printf("Chunk cache: %llu hits, %llu misses.\n",
+               (unsigned long long)stats->chunkHits,
+               (unsigned long long)stats->chunkMisses);
+    }
+
+    if (settings->referencePath != NULL) {
+        image *rendered = Image_ReadPPM(settings->outputPath);
+        image *reference = Image_ReadPPM(settings->referencePath);
+        if (rendered == NULL || reference == NULL) {
+            fprintf(stderr, "Could not read %s\n",
+                    rendered == NULL ? settings->outputPath
+                                     : settings->referencePath);
+            passed = false;
+        } else {
+            const double rmse = Image_RMSE(rendered, reference);
+            if (rmse < 0.0) {
+                fprintf(stderr, "Image size differs from reference %s\n",
+                        settings->referencePath);
+                passed = false;
+            } else if (rmse > settings->tolerance) {
+                fprintf(stderr, "Image RMSE %f exceeds tolerance %f\n", rmse,
+                        settings->tolerance);
+                passed = false;
+            } else {
+                printf("Image RMSE %f within tolerance %f.\n", rmse,
+                       settings->tolerance);
+            }
+        }
+        Image_Free(rendered);
+        Image_Free(reference);
+    }
+
+    if (settings->baselinePath != NULL) {
+        FILE *fp = fopen(settings->baselinePath, "r");
+        double baseline = 0.0;
+        if (fp == NULL || fscanf(fp, "%lf", &baseline) != 1) {
+            fprintf(stderr, "Could not read baseline %s\n",
+                    settings->baselinePath);
+            passed = false;
+        } else {
+            const double minimum = baseline * (1.0 - settings->margin);
+            if (raysPerSec < minimum) {
+                fprintf(stderr,
+                        "%.0f rays/sec is below baseline %.0f minus %.0f%%\n",
+                        raysPerSec, baseline, settings->margin * 100.0);
+                passed = false;
+            } else {
+                printf("%.0f rays/sec within %.0f%% of baseline %.0f.\n",
+                       raysPerSec, settings->margin * 100.0, baseline);
+            }
+        }
+        if (fp != NULL) {
+            fclose(fp);
+        }
+    }
+
+    if (settings->recordBaselinePath != NULL) {
+        FILE *fp = fopen(settings->recordBaselinePath, "w");
+        if (fp == NULL) {
+            perror("fopen");
+            passed = false;
+        } else {
+            fprintf(fp, "%.0f\n", raysPerSec);
+            fclose(fp);
+        }
+    }
+    return passed;
+}
+
+static void PrintUsage(const char *program) {
+    fprintf(stderr,
+            "Usage: %s [options]\n"
+            "  --width N               image width (default 600)\n"
+            "  --samples N             samples per pixel (default 100)\n"
+            "  --depth N               maximum bounce depth (default 50)\n"
+            "  --threads N             render threads (default 100)\n"
+            "  --seed N                random seed (default 1)\n"
+            "  --output FILE           output image (default output.ppm)\n"
+            "  --scene-extent N        random scene half-size in spheres "
+            "(default 11)\n"
+            "  --write-scene FILE      write the random scene as a chunked "
+            "scene file and exit\n"
+            "  --chunk-size N          spheres per chunk (default 256)\n"
+            "  --scene FILE            render a chunked scene file\n"
+            "  --chunk-cache N         resident chunks per thread (default "
+            "16)\n"
+            "  --strip-rows N          render and write N rows at a time "
+            "(default all)\n"
+            "  --aperture X            camera aperture, 0 for a pinhole "
+            "(default 0.1)\n"
+            "  --guide-passes N        path guiding training passes "
+            "(default 0, off)\n"
+            "  --guide-samples N       samples per pixel per training pass "
+            "(default 4)\n"
+            "  --guide-cell-size X     guiding cell size (default 0.5)\n"
+            "  --guide-fraction X      share of diffuse bounces sampled from "
+            "the guide (default 0.3)\n"
+            "  --env-map FILE          light the scene with a lat-long "
+            "Radiance .hdr image\n"
+            "  --env-scale X           environment map intensity (default "
+            "1.0)\n"
+            "  --reference FILE        fail if the output differs from FILE\n"
+            "  --tolerance RMSE        allowed RMSE in 0-255 units (default "
+            "2.0)\n"
+            "  --baseline FILE         fail if rays/sec drops below FILE\n"
+            "  --margin FRACTION       allowed slowdown (default 0.1)\n"
+            "  --runs N                render N times and report the fastest "
+            "run (default 1)\n"
+            "  --record-baseline FILE  write the measured rays/sec to FILE\n",
+            program);
 }
 
-int main() {
+static bool ParseSettings(int argc, char **argv, render_settings *settings) {
+    for (int i = 1; i < argc; ++i) {
+        const char *arg = argv[i];
+        if (i + 1 >= argc) {
+            return false;
+        }
+        const char *value = argv[++i];
+        if (strcmp(arg, "--width") == 0) {
+            settings->imageWidth = atoi(value);
+        } else if (strcmp(arg, "--samples") == 0) {
+            settings->samplesPerPixel = atoi(value);
+        } else if (strcmp(arg, "--depth") == 0) {
+            settings->maxDepth = atoi(value);
+        } else if (strcmp(arg, "--threads") == 0) {
+            settings->threadCount = atoi(value);
+        } else if (strcmp(arg, "--seed") == 0) {
+            settings->seed = strtoull(value, NULL, 10);
+        } else if (strcmp(arg, "--output") == 0) {
+            settings->outputPath = value;
+        } else if (strcmp(arg, "--scene-extent") == 0) {
+            settings->sceneExtent = atoi(value);
+        } else if (strcmp(arg, "--write-scene") == 0) {
+            settings->writeScenePath = value;
+        } else if (strcmp(arg, "--chunk-size") == 0) {
+            settings->chunkSize = atoi(value);
+        } else if (strcmp(arg, "--scene") == 0) {
+            settings->scenePath = value;
+        } else if (strcmp(arg, "--chunk-cache") == 0) {
+            settings->chunkCacheSlots = atoi(value);
+        } else if (strcmp(arg, "--strip-rows") == 0) {
+            settings->stripRows = atoi(value);
+        } else if (strcmp(arg, "--aperture") == 0) {
+            settings->aperture = atof(value);
+        } else if (strcmp(arg, "--guide-passes") == 0) {
+            settings->guidePasses = atoi(value);
+        } else if (strcmp(arg, "--guide-samples") == 0) {
+            settings->guideSamples = atoi(value);
+        } else if (strcmp(arg, "--guide-cell-size") == 0) {
+            settings->guideCellSize = atof(value);
+        } else if (strcmp(arg, "--guide-fraction") == 0) {
+            settings->guideFraction = atof(value);
+        } else if (strcmp(arg, "--env-map") == 0) {
+            settings->envMapPath = value;
+        } else if (strcmp(arg, "--env-scale") == 0) {
+            settings->envScale = atof(value);
+        } else if (strcmp(arg, "--reference") == 0) {
+            settings->referencePath = value;
+        } else if (strcmp(arg, "--tolerance") == 0) {
+            settings->tolerance = atof(value);
+        } else if (strcmp(arg, "--baseline") == 0) {
+            settings->baselinePath = value;
+        } else if (strcmp(arg, "--margin") == 0) {
+            settings->margin = atof(value);
+        } else if (strcmp(arg, "--runs") == 0) {
+            settings->runs = atoi(value);
+        } else if (strcmp(arg, "--record-baseline") == 0) {
+            settings->recordBaselinePath = value;
+        } else {
+            return false;
+        }
+    }
+    return settings->imageWidth > 1 && settings->samplesPerPixel > 0 &&
+           settings->maxDepth >= 0 && settings->threadCount > 0 &&
+           settings->sceneExtent >= 0 && settings->chunkSize > 0 &&
+           settings->chunkCacheSlots > 0 && settings->stripRows >= 0 &&
+           settings->aperture >= 0.0 && settings->guidePasses >= 0 &&
+           settings->guideSamples > 0 &&
+           settings->guideCellSize > 0.0 && settings->guideFraction >= 0.0 &&
+           settings->guideFraction < 1.0 && settings->envScale >= 0.0 &&
+           settings->runs > 0 &&
+           (int)(settings->imageWidth / settings->aspectRatio) > 1;
+}
+
+int main(int argc, char **argv) {
+
+    render_settings settings = {
+        .aspectRatio = 3.0 / 2.0,
+        .imageWidth = 600,
+        .samplesPerPixel = 100,
+        .maxDepth = 50,
+        .threadCount = 100,
+        .seed = 1,
+        .outputPath = "output.ppm",
+        .sceneExtent = 11,
+        .scenePath = NULL,
+        .writeScenePath = NULL,
+        .chunkSize = 256,
+        .chunkCacheSlots = 16,
+        .stripRows = 0,
+        .aperture = 0.1,
+        .guidePasses = 0,
+        .guideSamples = 4,
+        .guideCellSize = 0.5,
+        .guideFraction = 0.3,
+        .envMapPath = NULL,
+        .envScale = 1.0,
+        .referencePath = NULL,
+        .tolerance = 2.0,
+        .baselinePath = NULL,
+        .recordBaselinePath = NULL,
+        .margin = 0.1,
+        .runs = 1,
+    };
+    if (!ParseSettings(argc, argv, &settings)) {
+        PrintUsage(argv[0]);
+        return 2;
+    }
+
+    if (settings.writeScenePath != NULL) {
+        SeedRandom(settings.seed);
+        hittable_list *world = randomScene(settings.sceneExtent);
+        const bool written = ChunkedScene_Write(settings.writeScenePath, world,
+                                                (uint32_t)settings.chunkSize);
+        if (written) {
+            printf("Wrote %zu spheres to %s.\n", world->count,
+                   settings.writeScenePath);
+        }
+        free(world);
+        return written ? 0 : 1;
+    }
 
     // Not an ideal way to measure time
     // It's here to give a rough idea of time spent
     // same as in the go version here https://github.com/Miretz/raytracer-go
     clock_t start = clock();
 
-    Render();
+    // repeated runs render the same image, the fastest one is kept so
+    // throughput checks are less sensitive to other load on the machine
+    render_stats stats;
+    Render(&settings, &stats);
+    for (int run = 1; run < settings.runs; ++run) {
+        render_stats again;
+        Render(&settings, &again);
+        if (again.seconds < stats.seconds) {
+            stats = again;
+        }
+    }
 
     clock_t end = clock();
     float seconds = (float)(end - start) / CLOCKS_PER_SEC;
-    printf("The program took %f seconds.", seconds);
+    printf("The program took %f seconds.\n", seconds);
 
-    return 0;
+    return CheckRegression(&settings, &stats) ? 0 : 1;
 }
@@ -81,11 +81,11 @@ static inline bool Mat_Scatter(const material *l, const ray *rayIn,
                                ray *scattered) {
 
     switch (l->type) {
-    case 0:
+    case MATERIAL_LAMBERTIAN:
         return Lambertian_Scatter(l, rec, attenuation, scattered);
-    case 1:
+    case MATERIAL_METAL:
         return Metal_Scatter(l, rayIn, rec, attenuation, scattered);
-    case 2:
+    case MATERIAL_DIELECTRIC:
         return Dielectric_Scatter(l, rayIn, rec, attenuation, scattered);
     default:
         return Lambertian_Scatter(l, rec, attenuation, scattered);
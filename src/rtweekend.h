@@ -1,13 +1,35 @@
 #ifndef RTWEEKEND_H
 #define RTWEEKEND_H
 
+#include <stdint.h>
 #include <stdlib.h>
 
 const double Pi = 3.1415926535897932385;
 
 static inline double DegreesToRadians(const double degrees) { return degrees * Pi / 180.0; }
 
-static inline double RandomDouble() { return rand() / (RAND_MAX + 1.0); }
+// Each thread owns its generator state so renders are reproducible for a
+// given seed regardless of how rows are scheduled across threads.
+static _Thread_local uint64_t randomState = 0x9E3779B97F4A7C15ull;
+
+static inline void SeedRandom(uint64_t seed) {
+    // splitmix64 scrambles nearby seeds (e.g. row numbers) into unrelated
+    // starting states
+    uint64_t z = seed + 0x9E3779B97F4A7C15ull;
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    z = z ^ (z >> 31);
+    randomState = z ? z : 0x9E3779B97F4A7C15ull;
+}
+
+static inline double RandomDouble() {
+    // xorshift64*
+    randomState ^= randomState >> 12;
+    randomState ^= randomState << 25;
+    randomState ^= randomState >> 27;
+    return (double)((randomState * 0x2545F4914F6CDD1Dull) >> 11) *
+           (1.0 / 9007199254740992.0);
+}
 
 static inline double RandomBetween(const double min, const double max) {
     return min + (max - min) * RandomDouble();
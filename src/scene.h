@@ -0,0 +1,27 @@
+#ifndef SCENE_H
+#define SCENE_H
+
+#include <stdbool.h>
+
+#include "chunked_scene.h"
+#include "envmap.h"
+#include "hittable_list.h"
+
+// A thread's view of the world, either an in-memory list or a chunked scene
+// file paged through the thread's own cache, lit by the sky gradient or an
+// environment map
+typedef struct scene {
+    hittable_list *list;
+    chunk_cache *cache;
+    const env_map *env;
+} scene;
+
+static inline bool Scene_Hit(scene *world, const ray *r, const double tMin,
+                             const double tMax, hit_record *rec) {
+    if (world->cache != NULL) {
+        return ChunkedScene_Hit(world->cache, r, tMin, tMax, rec);
+    }
+    return Hittable_Hit(world->list, r, tMin, tMax, rec);
+}
+
+#endif